@@ -0,0 +1,8 @@
+-- The data set of every benchmark but the SDF scans: the 80 molecules of
+-- data/drugs.smi, repeated 1250 times, i.e. 100,000 rows
+CREATE TABLE smiles AS
+SELECT smiles, name
+FROM read_csv('benchmark/rdkit/data/drugs.smi', delim = ' ', header = false,
+              columns = {'smiles': 'VARCHAR', 'name': 'VARCHAR'}),
+     range(1250);
+CREATE TABLE molecules AS SELECT mol_from_smiles(smiles) AS m, name FROM smiles;
@@ -0,0 +1,25 @@
+-- The share of the molecules that pass the pattern fingerprint screen for
+-- the queries of the substructure benchmarks, compared to the share that
+-- actually match. Run it from the root of the repository with
+--   ./build/release/duckdb < benchmark/rdkit/screen_pass_rates.sql
+.read benchmark/rdkit/load_molecules.sql
+
+CREATE TABLE queries (selectivity VARCHAR, query Mol);
+INSERT INTO queries VALUES
+  ('none', 'P(=O)(O)O'),
+  ('rare', 'c1ccc2[nH]ccc2c1'),
+  ('medium', 'S(=O)(=O)N'),
+  ('common', 'C(=O)O'),
+  ('most', 'c1ccccc1');
+
+CREATE TABLE fingerprints AS SELECT m, pattern_fp(m) AS fp FROM molecules;
+
+SELECT selectivity, mol_to_smiles(query) AS query,
+       count(*) AS molecules,
+       count(*) FILTER (WHERE bfp_contains(fp, pattern_fp(query))) AS screened,
+       count(*) FILTER (WHERE is_substruct(m, query)) AS matches,
+       round(screened / molecules, 3) AS screen_pass_rate,
+       round(matches / molecules, 3) AS match_rate
+FROM queries, fingerprints
+GROUP BY ALL
+ORDER BY match_rate;
@@ -0,0 +1,49 @@
+#!/usr/bin/python3
+
+# Summarizes the output of the benchmark runner as the median time and the
+# number of rows per second of each benchmark. The number of rows is the
+# "# rows:" comment of the benchmark file, or of the template it uses.
+#
+# usage: python3 scripts/benchmark_report.py bench_output.txt
+
+import re
+import statistics
+import sys
+from collections import defaultdict
+from pathlib import Path
+
+
+def benchmark_rows(path):
+    path = Path(path)
+    if not path.exists():
+        return None
+    text = path.read_text()
+    rows = re.search(r"^# rows:\s*(\d+)", text, re.MULTILINE)
+    if rows:
+        return int(rows.group(1))
+    template = re.search(r"^template\s+(\S+)", text, re.MULTILINE)
+    if template:
+        return benchmark_rows(template.group(1))
+    return None
+
+
+if len(sys.argv) != 2:
+    raise Exception("usage: python3 benchmark_report.py <runner output>")
+
+timings = defaultdict(list)
+for line in Path(sys.argv[1]).read_text().splitlines():
+    fields = line.split("\t")
+    if len(fields) != 3 or not fields[0].endswith(".benchmark"):
+        continue
+    try:
+        timings[fields[0]].append(float(fields[2]))
+    except ValueError:
+        # a benchmark that failed or timed out
+        continue
+
+print(f"{'benchmark':<60} {'median (s)':>12} {'rows/sec':>14}")
+for name in sorted(timings):
+    median = statistics.median(timings[name])
+    rows = benchmark_rows(name)
+    rate = f"{rows / median:,.0f}" if rows and median > 0 else "-"
+    print(f"{name:<60} {median:>12.4f} {rate:>14}")
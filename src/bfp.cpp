@@ -0,0 +1,71 @@
+#include "bfp.hpp"
+#include "duckdb/common/helper.hpp"
+#include <bit>
+#include <vector>
+
+namespace duckdb_rdkit {
+
+std::string make_bfp_string(const ExplicitBitVect &bv) {
+  uint32_t num_bits = bv.getNumBits();
+  idx_t word_count = (num_bits + 63) / 64;
+  std::vector<uint64_t> words(word_count, 0);
+
+  IntVect on_bits;
+  bv.getOnBits(on_bits);
+  for (auto bit : on_bits) {
+    words[bit / 64] |= uint64_t(1) << (bit % 64);
+  }
+
+  uint32_t popcount = on_bits.size();
+  std::string buffer;
+  buffer.resize(bfp_t::HEADER_BYTES + word_count * bfp_t::WORD_BYTES);
+  memcpy(&buffer[0], &popcount, sizeof(uint32_t));
+  memcpy(&buffer[sizeof(uint32_t)], &num_bits, sizeof(uint32_t));
+  memcpy(&buffer[bfp_t::HEADER_BYTES], words.data(),
+         word_count * bfp_t::WORD_BYTES);
+  return buffer;
+}
+
+// The loop below is auto-vectorized by the compiler. Building it for several
+// targets lets it use the AVX-512 popcount instructions on CPUs that have them
+// while the extension still loads on CPUs that do not. This relies on ifunc
+// support, so it is only done on x86-64 Linux
+#if defined(__x86_64__) && defined(__linux__) &&                               \
+    (defined(__GNUC__) || defined(__clang__))
+#define BFP_POPCOUNT_TARGETS                                                   \
+  __attribute__((target_clones("avx512vpopcntdq", "avx2", "popcnt",            \
+                               "default")))
+#else
+#define BFP_POPCOUNT_TARGETS
+#endif
+
+BFP_POPCOUNT_TARGETS
+uint64_t bfp_intersect_popcount(const_data_ptr_t a, const_data_ptr_t b,
+                                idx_t word_count) {
+  uint64_t common = 0;
+  for (idx_t i = 0; i < word_count; i++) {
+    uint64_t a_word, b_word;
+    // the words are not necessarily aligned in duckdb's memory
+    memcpy(&a_word, a + i * sizeof(uint64_t), sizeof(uint64_t));
+    memcpy(&b_word, b + i * sizeof(uint64_t), sizeof(uint64_t));
+    common += std::popcount(a_word & b_word);
+  }
+  return common;
+}
+
+bool bfp_contains_words(const_data_ptr_t a, const_data_ptr_t b,
+                        idx_t word_count) {
+  // Most targets fail the screen early, so this returns on the first word
+  // that misses a bit instead of being vectorized over all of them
+  for (idx_t i = 0; i < word_count; i++) {
+    uint64_t a_word, b_word;
+    memcpy(&a_word, a + i * sizeof(uint64_t), sizeof(uint64_t));
+    memcpy(&b_word, b + i * sizeof(uint64_t), sizeof(uint64_t));
+    if ((b_word & ~a_word) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace duckdb_rdkit
@@ -19,23 +19,45 @@
 
 namespace duckdb_rdkit {
 
+struct MolCastLocalState : public FunctionLocalState {
+  UmbraMolOptions options;
+  SmilesMolParser parser;
+  std::string error;
+};
+
+static unique_ptr<FunctionLocalState>
+InitMolCastLocalState(CastLocalStateParameters &parameters) {
+  auto state = make_uniq<MolCastLocalState>();
+  if (parameters.context) {
+    state->options = GetUmbraMolOptions(*parameters.context);
+  }
+  return std::move(state);
+}
+
 // This enables the user to insert into a Mol column by just writing the SMILES
 // Duckdb will try to convert the string to a rdkit mol
 // This is consistent with the RDKit Postgres cartridge behavior
 bool VarcharToMolCast(Vector &source, Vector &result, idx_t count,
                       CastParameters &parameters) {
   bool all_converted = true;
+  // Casts without a local state (e.g. when constant folding) get their own
+  // parser for the whole vector
+  unique_ptr<MolCastLocalState> owned_state;
+  if (!parameters.local_state) {
+    owned_state = make_uniq<MolCastLocalState>();
+  }
+  auto &lstate = parameters.local_state
+                     ? parameters.local_state->Cast<MolCastLocalState>()
+                     : *owned_state;
   UnaryExecutor::ExecuteWithNulls<string_t, string_t>(
       source, result, count,
       [&](string_t smiles, ValidityMask &mask, idx_t idx) {
-        try {
-          // this varchar is just a regular string, not a umbramol
-          // Try to see if it is a SMILES
-          auto mol = rdkit_mol_from_smiles(smiles.GetString());
-          auto umbra_mol = get_umbra_mol_string(*mol);
-
-          return StringVector::AddStringOrBlob(result, umbra_mol);
-        } catch (...) {
+        // this varchar is just a regular string, not a umbramol
+        // Try to see if it is a SMILES
+        auto mol = lstate.parser.Parse(
+            std::string_view(smiles.GetData(), smiles.GetSize()),
+            lstate.options.sanitize, lstate.error);
+        if (!mol) {
           std::string error_msg = StringUtil::Format(
               "Could not convert string '%s' to Mol", smiles.GetString());
           if (parameters.strict) {
@@ -46,25 +68,16 @@ bool VarcharToMolCast(Vector &source, Vector &result, idx_t count,
           mask.SetInvalid(idx);
           return string_t();
         }
+        auto umbra_mol = get_umbra_mol_string(*mol, lstate.options);
+        return StringVector::AddStringOrBlob(result, umbra_mol);
       });
   return all_converted;
 }
 
 void MolToVarchar(Vector &source, Vector &result, idx_t count) {
-  UnaryExecutor::Execute<string_t, string_t>(
-      source, result, count, [&](string_t b_umbra_mol) {
-        // The input is a string_t coming from the duckdb internals.
-        // The extension recognizes that this string_t is an
-        // UmbraMol BLOB and will trigger this cast function.
-        // Therefore, this function expects that the input
-        // contains a string that has the format of umbra_mol_t.
-        auto umbra_mol = umbra_mol_t(b_umbra_mol);
-        auto bmol = umbra_mol.GetBinaryMol();
-
-        auto rdkit_mol = rdkit_binary_mol_to_mol(bmol);
-        auto smiles = rdkit_mol_to_smiles(*rdkit_mol);
-        return StringVector::AddString(result, smiles);
-      });
+  // The extension recognizes that the BLOB is a Mol and triggers this cast
+  // function, so the input has the format of umbra_mol_t
+  MolVectorToSmiles(source, result, count, nullptr);
 }
 
 bool MolToVarcharCast(Vector &source, Vector &result, idx_t count,
@@ -73,12 +86,47 @@ bool MolToVarcharCast(Vector &source, Vector &result, idx_t count,
   return true;
 }
 
+// A qmol is the SMARTS text, so the cast only has to check that the SMARTS
+// can be parsed
+bool VarcharToQMolCast(Vector &source, Vector &result, idx_t count,
+                       CastParameters &parameters) {
+  bool all_converted = true;
+  UnaryExecutor::ExecuteWithNulls<string_t, string_t>(
+      source, result, count,
+      [&](string_t smarts, ValidityMask &mask, idx_t idx) {
+        try {
+          rdkit_mol_from_smarts(smarts.GetString());
+          return StringVector::AddString(result, smarts);
+        } catch (...) {
+          std::string error_msg = StringUtil::Format(
+              "Could not convert string '%s' to qmol", smarts.GetString());
+          if (parameters.strict) {
+            throw ConversionException(error_msg);
+          }
+          HandleCastError::AssignError(error_msg, parameters);
+          all_converted = false;
+          mask.SetInvalid(idx);
+          return string_t();
+        }
+      });
+  return all_converted;
+}
+
 void RegisterCasts(ExtensionLoader &loader) {
   loader.RegisterCastFunction(LogicalType::VARCHAR, ::duckdb_rdkit::Mol(),
-                              BoundCastInfo(VarcharToMolCast), 1);
+                              BoundCastInfo(VarcharToMolCast, nullptr,
+                                            InitMolCastLocalState),
+                              1);
 
   loader.RegisterCastFunction(duckdb_rdkit::Mol(), LogicalType::VARCHAR,
                               BoundCastInfo(MolToVarcharCast), 1);
+
+  // Strings are cast to Mol rather than to qmol when a function has
+  // overloads for both, so SMARTS queries have to be asked for with ::qmol
+  loader.RegisterCastFunction(LogicalType::VARCHAR, duckdb_rdkit::QMol(),
+                              BoundCastInfo(VarcharToQMolCast), 2);
+  loader.RegisterCastFunction(duckdb_rdkit::QMol(), LogicalType::VARCHAR,
+                              BoundCastInfo(DefaultCasts::ReinterpretCast), 1);
 }
 
 } // namespace duckdb_rdkit
@@ -2,14 +2,20 @@
 #include "mol_descriptors.hpp"
 #include "rdkit_log.hpp"
 #include "sdf_scanner/sdf_functions.hpp"
+#include "smiles_scanner/smiles_functions.hpp"
 
 #define DUCKDB_EXTENSION_MAIN
 #include "cast.hpp"
 #include "duckdb/main/extension/extension_loader.hpp"
 #include "duckdb_rdkit_extension.hpp"
 #include "mol_compare.hpp"
+#include "mol_copy.hpp"
+#include "mol_fingerprints.hpp"
 #include "mol_formats.hpp"
+#include "mol_scaffolds.hpp"
+#include "similarity_search.hpp"
 #include "types.hpp"
+#include "umbra_mol.hpp"
 #include <GraphMol/FileParsers/FileParsers.h>
 #include <GraphMol/GraphMol.h>
 #include <GraphMol/MolPickler.h>
@@ -22,21 +28,31 @@
 namespace duckdb {
 
 static void LoadInternal(ExtensionLoader &loader) {
+  duckdb_rdkit::PrecompileDalkeFragments();
+
   duckdb_rdkit::RegisterTypes(loader);
+  duckdb_rdkit::RegisterUmbraMolSettings(loader);
   duckdb_rdkit::RegisterCasts(loader);
   duckdb_rdkit::RegisterFormatFunctions(loader);
   duckdb_rdkit::RegisterCompareFunctions(loader);
   duckdb_rdkit::RegisterDescriptorFunctions(loader);
+  duckdb_rdkit::RegisterFingerprintFunctions(loader);
+  duckdb_rdkit::RegisterScaffoldFunctions(loader);
+  duckdb_rdkit::RegisterSimilaritySearchFunctions(loader);
   duckdb_rdkit::RegisterLogFunctions(loader);
+  duckdb_rdkit::RegisterCopyFunctions(loader);
 
   for (auto &fun : SDFFunctions::GetTableFunctions()) {
     loader.RegisterFunction(fun);
   }
+  loader.RegisterFunction(SMILESFunctions::GetReadSMILESTableFunction());
 
-  // SDF replacement scan
+  // SDF and SMILES replacement scans
   auto &instance = loader.GetDatabaseInstance();
   auto &config = DBConfig::GetConfig(instance);
   config.replacement_scans.emplace_back(SDFFunctions::ReadSDFReplacement);
+  config.replacement_scans.emplace_back(
+      SMILESFunctions::ReadSMILESReplacement);
 }
 
 void DuckdbRdkitExtension::Load(ExtensionLoader &loader) {
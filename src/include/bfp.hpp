@@ -0,0 +1,101 @@
+#pragma once
+#include "common.hpp"
+#include <DataStructs/ExplicitBitVect.h>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace duckdb_rdkit {
+
+// A bit-vector fingerprint, stored in the bfp type (a BLOB under the hood,
+// just like the Mol type).
+//
+// The layout is:
+//   4 bytes  number of bits that are set (the popcount)
+//   4 bytes  number of bits in the fingerprint
+//   n bytes  the bits, as little-endian 64-bit words. Bit i is bit i % 64 of
+//            word i / 64, and the unused bits of the last word are zero
+//
+// The popcount is the first 4 bytes so that it is inlined by duckdb as the
+// PREFIX of the string_t. The similarity functions only need the popcount of
+// the intersection of two fingerprints on top of the popcounts that are
+// stored, and a similarity bound can be computed from the prefix alone,
+// without chasing the pointer to the bits.
+struct bfp_t {
+  string_t &string_t_bfp;
+
+  bfp_t(string_t &buffer) : string_t_bfp(buffer) {}
+
+  static constexpr idx_t HEADER_BYTES = 2 * sizeof(uint32_t);
+  static constexpr idx_t WORD_BYTES = sizeof(uint64_t);
+
+  uint32_t GetPopcount() const {
+    return Load<uint32_t>(const_data_ptr_cast(string_t_bfp.GetPrefix()));
+  }
+
+  uint32_t GetNumBits() const {
+    if (string_t_bfp.GetSize() < HEADER_BYTES) {
+      return 0;
+    }
+    return Load<uint32_t>(
+        const_data_ptr_cast(string_t_bfp.GetData() + sizeof(uint32_t)));
+  }
+
+  idx_t GetWordCount() const {
+    if (string_t_bfp.GetSize() < HEADER_BYTES) {
+      return 0;
+    }
+    return (string_t_bfp.GetSize() - HEADER_BYTES) / WORD_BYTES;
+  }
+
+  const_data_ptr_t GetWords() const {
+    return const_data_ptr_cast(string_t_bfp.GetData() + HEADER_BYTES);
+  }
+
+  // Throws if the value is not a valid bfp, e.g. a BLOB that was cast to bfp
+  void Verify() const {
+    auto size = string_t_bfp.GetSize();
+    if (size < HEADER_BYTES || (size - HEADER_BYTES) % WORD_BYTES != 0 ||
+        (GetNumBits() + 63) / 64 != GetWordCount()) {
+      throw InvalidInputException("Invalid bfp fingerprint");
+    }
+  }
+};
+
+// Serializes an RDKit bit vector to the bfp layout
+std::string make_bfp_string(const ExplicitBitVect &bv);
+
+// The number of bits that are set in both fingerprints. This is the kernel of
+// all similarity functions, and is compiled for several instruction sets
+// where the compiler supports it (AVX-512 VPOPCNTDQ, AVX2, POPCNT), with the
+// best one picked at load time
+uint64_t bfp_intersect_popcount(const_data_ptr_t a, const_data_ptr_t b,
+                                idx_t word_count);
+
+// Whether every bit that is set in b is also set in a. This is the screen of
+// a substructure search: a pattern fingerprint of a query can only be
+// contained in the pattern fingerprint of a target if the query is a
+// substructure of the target
+bool bfp_contains_words(const_data_ptr_t a, const_data_ptr_t b,
+                        idx_t word_count);
+
+inline double tanimoto_sml(uint32_t a_count, uint32_t b_count,
+                           uint64_t common) {
+  auto denominator = (double)a_count + (double)b_count - (double)common;
+  return denominator == 0 ? 0.0 : (double)common / denominator;
+}
+
+inline double dice_sml(uint32_t a_count, uint32_t b_count, uint64_t common) {
+  auto denominator = (double)a_count + (double)b_count;
+  return denominator == 0 ? 0.0 : 2.0 * (double)common / denominator;
+}
+
+inline double tversky_sml(uint32_t a_count, uint32_t b_count, uint64_t common,
+                          double alpha, double beta) {
+  auto denominator = alpha * ((double)a_count - (double)common) +
+                     beta * ((double)b_count - (double)common) +
+                     (double)common;
+  return denominator == 0 ? 0.0 : (double)common / denominator;
+}
+
+} // namespace duckdb_rdkit
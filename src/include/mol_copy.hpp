@@ -0,0 +1,9 @@
+#pragma once
+#include "common.hpp"
+
+namespace duckdb_rdkit {
+
+// COPY ... TO '...' (FORMAT sdf) and (FORMAT smi)
+void RegisterCopyFunctions(ExtensionLoader &loader);
+
+} // namespace duckdb_rdkit
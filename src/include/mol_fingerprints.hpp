@@ -0,0 +1,5 @@
+#pragma once
+#include "common.hpp"
+namespace duckdb_rdkit {
+void RegisterFingerprintFunctions(ExtensionLoader &loader);
+} // namespace duckdb_rdkit
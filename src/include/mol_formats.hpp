@@ -1,16 +1,116 @@
 #pragma once
 #include "common.hpp"
+#include "rdkit_memory.hpp"
 #include "types.hpp"
+#include "umbra_mol.hpp"
 #include <GraphMol/GraphMol.h>
+#include <GraphMol/RWMol.h>
+#include <GraphMol/SmilesParse/SmilesParse.h>
+#include <list>
+#include <string_view>
+#include <unordered_map>
 
 namespace duckdb_rdkit {
 
 // these functions are used in other parts of the extension, for example in
 // casts
-std::unique_ptr<RDKit::ROMol> rdkit_mol_from_smiles(std::string s);
-std::string rdkit_mol_to_binary_mol(const RDKit::ROMol mol);
-std::unique_ptr<RDKit::ROMol> rdkit_binary_mol_to_mol(std::string bmol);
-std::string rdkit_mol_to_smiles(RDKit::ROMol mol);
+std::unique_ptr<RDKit::ROMol> rdkit_mol_from_smiles(const std::string &s);
+// Throws if the SMARTS cannot be parsed
+std::unique_ptr<RDKit::ROMol> rdkit_mol_from_smarts(const std::string &smarts);
+std::string rdkit_mol_to_binary_mol(const RDKit::ROMol &mol);
+// The pickle is read directly from the memory the view points to, so this can
+// be called with umbra_mol_t::GetBinaryMolView() without copying the pickle
+std::unique_ptr<RDKit::ROMol> rdkit_binary_mol_to_mol(std::string_view bmol);
+// Deserializes into an existing molecule, replacing its contents. Reusing the
+// same molecule for many rows saves allocating a new one for each of them
+void rdkit_binary_mol_to_mol(std::string_view bmol, RDKit::RWMol &mol);
+// Deserializes the molecule of a Mol value, from its pickle or its SMILES,
+// sanitizing it if it was stored unsanitized. Functions that work with the
+// RDKit molecule of a value use these rather than reading the pickle
+// themselves
+std::unique_ptr<RDKit::ROMol> rdkit_mol_from_umbra_mol(const umbra_mol_t &m);
+void rdkit_mol_from_umbra_mol(const umbra_mol_t &m, RDKit::RWMol &mol);
+std::string rdkit_mol_to_smiles(const RDKit::ROMol &mol);
+
+// A size-bounded cache of deserialized molecules, keyed by the bytes of the
+// Mol values. Without it, a query that calls several functions on the same
+// molecule, e.g. mol_logp(m), mol_tpsa(m) and is_substruct(m, q), unpickles
+// it once for every function. There is one cache per thread, which only
+// that thread uses, see GetMolCache.
+// The memory of the cached molecules is reserved with the buffer manager.
+// When the memory limit is reached, the cache evicts molecules rather than
+// failing the query
+class MolCache {
+public:
+  // Returns the molecule of the value, which is only deserialized if it is
+  // not cached. The reference is valid until the next call of Get
+  const RDKit::ROMol &Get(const umbra_mol_t &m);
+  // Evicts the least recently used molecules until at most `capacity` are
+  // left. A capacity of 0 disables the cache
+  void SetCapacity(idx_t capacity);
+  // Reserves the memory of the molecules with the database of `context`
+  void SetDatabase(ClientContext &context);
+
+private:
+  struct Entry {
+    hash_t hash;
+    // The bytes of the Mol value
+    std::string key;
+    std::unique_ptr<RDKit::ROMol> mol;
+    // The memory of the entry, see EstimateMolMemory
+    idx_t memory;
+  };
+  void EvictLast();
+  // Updates the reservation after molecules were added or evicted, evicting
+  // more of them if the memory limit is reached
+  void Reserve();
+
+  idx_t capacity = 0;
+  // The most recently used molecule is at the front
+  std::list<Entry> entries;
+  std::unordered_map<hash_t, std::list<Entry>::iterator> index;
+  // While the cache is disabled, the molecules are deserialized into this
+  // one, which is reused from row to row
+  RDKit::RWMol uncached;
+  // The memory of the entries, and of the largest molecule that was
+  // deserialized into `uncached`
+  idx_t cached_memory = 0;
+  idx_t uncached_memory = 0;
+  RDKitMemoryReservation memory;
+};
+
+// Returns the cache of the calling thread, sized by the rdkit_mol_cache_size
+// setting
+MolCache &GetMolCache(ClientContext &context);
+
+// Writes the canonical SMILES of the Mol values of source to result, for
+// mol_to_smiles and the cast to VARCHAR. The molecules are taken from the
+// cache if there is one.
+// The SMILES of a constant vector is computed once. For a dictionary vector,
+// e.g. from a compressed column or a join that repeats rows, the SMILES of
+// each dictionary entry that is used is computed once, and the result is a
+// dictionary vector over them
+void MolVectorToSmiles(Vector &source, Vector &result, idx_t count,
+                       MolCache *cache);
+
+// Parses SMILES, reporting invalid input through the return value instead of
+// an exception. The parser is meant to be kept in a per-thread state (e.g. of
+// a cast or a scan) and reused for all of its rows, so that its params and
+// buffer are only set up once
+class SmilesMolParser {
+public:
+  // Returns nullptr and sets `error` if the SMILES cannot be parsed or the
+  // molecule cannot be sanitized. Without sanitization, only the valences
+  // of the atoms are checked
+  std::unique_ptr<RDKit::RWMol> Parse(std::string_view smiles, bool sanitize,
+                                      std::string &error);
+
+private:
+  RDKit::SmilesParserParams params;
+  // RDKit takes a std::string, which is reused so that it is only allocated
+  // once per thread
+  std::string buffer;
+};
 
 void RegisterFormatFunctions(ExtensionLoader &loader);
 } // namespace duckdb_rdkit
@@ -0,0 +1,9 @@
+#pragma once
+#include "common.hpp"
+
+namespace duckdb_rdkit {
+
+// mol_murcko_scaffold(mol) and mol_scaffold_hash(mol)
+void RegisterScaffoldFunctions(ExtensionLoader &loader);
+
+} // namespace duckdb_rdkit
@@ -12,6 +12,13 @@ namespace duckdb_rdkit {
 // QED paper: Bickerton, G.R.; Paolini, G.V.; Besnard, J.; Muresan, S.; Hopkins,
 // A.L. (2012) 'Quantifying the chemical beauty of drugs', Nature Chemistry, 4,
 // 90-98
+//
+// Building a QED object parses all of the acceptor, structural alert and
+// aliphatic ring SMARTS, which is far more expensive than calculating the QED
+// of a molecule. Use QED::Get() to get the process-wide instance that is
+// built once and is then only read from. Reading the pattern molecules from
+// several threads at once is safe as RDKit is built with
+// RDK_BUILD_THREADSAFE_SSS (needed for the recursive SMARTS).
 class QED {
 public:
   QED() {
@@ -20,7 +27,10 @@ public:
     aliphaticRingsMol.reset(RDKit::SmartsToMol(aliphaticRingSmarts));
   }
 
-  float CalcQED(const RDKit::ROMol &mol);
+  // The shared, immutable QED instance
+  static const QED &Get();
+
+  float CalcQED(const RDKit::ROMol &mol) const;
 
 private:
   struct ADSparameter {
@@ -59,7 +69,8 @@ private:
 
   // Helper function to convert a vector of SMARTS to a vector of RDKit
   // molecules
-  std::vector<RDKit::RWMol> smarts2mols(std::vector<std::string> smarts);
+  static std::vector<RDKit::RWMol>
+  smarts2mols(const std::vector<std::string> &smarts);
   //  Asymmetric Double Sigmoidal (ADS) function parameters used to model the
   //  histogram. Parameters provided by the paper (see top of file)
   std::unordered_map<std::string, ADSparameter> adsParameters = {
@@ -165,13 +176,10 @@ private:
   // Compute the RDKit molecule objects for hydrogen bond acceptors
   std::vector<std::unique_ptr<RDKit::RWMol>> getAcceptorMols();
   // Calculate the properties needed for the QED descriptor
-  QEDproperties calcProperties(const RDKit::ROMol &mol,
-                               std::vector<RDKit::RWMol> acceptorMols,
-                               std::unique_ptr<RDKit::RWMol> aliphaticRingMol,
-                               std::vector<RDKit::RWMol> alertMols);
+  QEDproperties calcProperties(const RDKit::ROMol &mol) const;
   // Compute the asymmetric double sigmoidal function using the value of the
   // descriptor of interest (the parameter `x` in the function) and the
   // adsParameters for that descriptor of interest
-  double calcADS(float x, std::string adsParameterKey);
+  double calcADS(float x, const std::string &adsParameterKey) const;
 };
 } // namespace duckdb_rdkit
@@ -1,8 +1,36 @@
 #pragma once
 #include "common.hpp"
+#include <string>
 
 namespace duckdb_rdkit {
 
+// What the screens of is_exact_match and the substructure functions saved:
+// how many rows each screen ruled out, how many had to be matched by RDKit,
+// and how long that took. The functions count them per thread, and add them
+// to the totals returned by rdkit_stats() after every chunk
+struct ScreenStats {
+  // The rows where neither the target nor the query is NULL
+  uint64_t rows = 0;
+  // Ruled out by the 4 bytes of the dalke fp inlined in the string_t
+  uint64_t prefix_rejected = 0;
+  // Ruled out by the other 4 bytes of the dalke fp
+  uint64_t dalke_fp_rejected = 0;
+  // Ruled out by the pattern fingerprint screen in the header
+  uint64_t screen_rejected = 0;
+  // Ruled out by the hash of the canonical SMILES (is_exact_match only)
+  uint64_t hash_rejected = 0;
+  // Deserialized and matched by RDKit
+  uint64_t full_match_rows = 0;
+  // The rows where the query matched
+  uint64_t matches = 0;
+  // Time spent deserializing and matching the rows sent to RDKit
+  uint64_t rdkit_nanos = 0;
+};
+
+// Adds the counters of a thread to the totals of the function, and resets
+// them
+void FlushScreenStats(const std::string &function_name, ScreenStats &stats);
+
 void RegisterLogFunctions(ExtensionLoader &loader);
 
 } // namespace duckdb_rdkit
@@ -0,0 +1,50 @@
+#pragma once
+#include "common.hpp"
+#include <GraphMol/ROMol.h>
+
+namespace duckdb_rdkit {
+
+// RDKit allocates its molecules on the C++ heap, where DuckDB's memory_limit
+// does not see them. The functions that keep molecules around for more than
+// a row (the molecule cache, the queries and reused targets of the
+// comparison functions, the scanners) reserve an estimate of their size with
+// the buffer manager instead. The reservations show up under the EXTENSION
+// tag of duckdb_memory(), and growing one past the memory limit first evicts
+// buffers, then fails with an OutOfMemoryException like any other operator.
+
+// An estimate of the memory of a deserialized molecule: its atoms and bonds,
+// the graph that connects them, and the ring info
+idx_t EstimateMolMemory(const RDKit::ROMol &mol);
+
+// Memory reserved with the buffer manager of a database. The database is only
+// referenced weakly, so a reservation that outlives it, e.g. in a thread_local
+// cache, is dropped rather than released into a buffer manager that is gone
+class RDKitMemoryReservation {
+public:
+  RDKitMemoryReservation() = default;
+  explicit RDKitMemoryReservation(ClientContext &context);
+  ~RDKitMemoryReservation();
+
+  RDKitMemoryReservation(const RDKitMemoryReservation &) = delete;
+  RDKitMemoryReservation &operator=(const RDKitMemoryReservation &) = delete;
+
+  // Moves the reservation to the database of `context`, if it is held with
+  // another one
+  void SetDatabase(ClientContext &context);
+  // Grows or shrinks the reservation to `size` bytes. Throws an
+  // OutOfMemoryException if it cannot grow, which leaves it as it was
+  void Resize(idx_t size);
+  idx_t GetSize() const { return size; }
+
+private:
+  weak_ptr<DatabaseInstance> db;
+  idx_t size = 0;
+};
+
+// The number of threads of a scan that each need about `thread_memory`
+// bytes, at most `max_threads`, so that they fit in the memory that is left
+// under the memory limit. At least one thread is always used
+idx_t MemoryBoundThreads(ClientContext &context, idx_t thread_memory,
+                         idx_t max_threads);
+
+} // namespace duckdb_rdkit
@@ -1,11 +1,18 @@
 #pragma once
-#include "GraphMol/FileParsers/MolSupplier.h"
+#include "GraphMol/FileParsers/FileParsers.h"
+#include "duckdb/common/file_system.hpp"
 #include "duckdb/common/multi_file/multi_file_reader.hpp"
+#include "duckdb/common/mutex.hpp"
 #include "duckdb/common/unique_ptr.hpp"
 #include "duckdb/execution/execution_context.hpp"
 #include "duckdb/function/function.hpp"
 #include "duckdb/function/table_function.hpp"
 #include "duckdb/main/client_context.hpp"
+#include "duckdb/planner/table_filter.hpp"
+#include "rdkit_memory.hpp"
+#include "umbra_mol.hpp"
+#include <atomic>
+#include <unordered_map>
 
 namespace duckdb {
 
@@ -34,24 +41,206 @@ public:
   //! A value of -1 means there is no mol_col_idx set because Mol type was
   //! not requested
   short mol_col_idx = -1;
+
+  //! The index of the column holding the name of the file a record was read
+  //! from, if the "filename" option is set. -1 if it is not set
+  short filename_col_idx = -1;
+
+  //! The types of all columns, in the same order as names
+  vector<LogicalType> return_types;
+
+  //! The size in bytes of the ranges a file is split into. Each range is
+  //! scanned by one thread at a time
+  idx_t buffer_size = DEFAULT_BUFFER_SIZE;
+  static constexpr idx_t DEFAULT_BUFFER_SIZE = 8 * 1024 * 1024;
+};
+
+//! A byte range of an SDF file that is scanned by a single thread
+struct SDFScanRange {
+  //! The index of the range over all files, used as the batch index so that
+  //! duckdb can keep the records in the order they are in the files
+  idx_t range_idx;
+  //! The index of the file in the bind data
+  idx_t file_idx;
+  idx_t start;
+  idx_t end;
+};
+
+//! Reads the records in a byte range of an SDF file.
+//!
+//! A record belongs to the range in which the "$$$$" line before it starts.
+//! The first record of the file belongs to the range starting at byte 0.
+//! Because of this, the last record of a range can extend past the end of the
+//! range, in which case the reader keeps reading until the record is complete,
+//! and the first bytes of a range (up to and including its first "$$$$" line)
+//! belong to records of the previous range.
+class SDFRangeReader {
+public:
+  void Reset(FileHandle &handle, idx_t file_size, const SDFScanRange &range);
+
+  //! Sets `record` to the text of the next record of the range, including
+  //! its "$$$$" line. Returns false when there are no records left
+  bool NextRecord(string &record, idx_t &record_start);
+
+  //! Whether all records of the range have been read
+  bool Finished() const { return finished; }
+
+private:
+  //! Appends the next line (including the newline) to `line`.
+  //! Returns false at the end of the file
+  bool ReadLine(string &line);
+  static bool IsRecordTerminator(const string &line);
+
+  optional_ptr<FileHandle> handle;
+  idx_t file_size = 0;
+  idx_t range_end = 0;
+
+  //! Whether the next line is the first line of a record of this range
+  bool at_record_start = false;
+  bool finished = true;
+
+  //! The file offset of the next byte to read
+  idx_t position = 0;
+  //! Read buffer, and the file offset of its first byte
+  unsafe_unique_array<char> buffer;
+  idx_t buffer_offset = 0;
+  idx_t buffer_length = 0;
+  static constexpr idx_t READ_BUFFER_SIZE = 1024 * 1024;
 };
 
+//! Parses the parts of an SDF record without building the molecule.
+//!
+//! A record is a molblock, which ends with the "M  END" line, followed by
+//! data items. Each data item is a header line starting with ">" that holds
+//! the name of the item in angle brackets (e.g. "> <ChEBI ID>"), followed by
+//! the lines of its value up to a blank line.
+struct SDFRecordParser {
+  //! Returns the offset just past the "M  END" line of the record, or the
+  //! size of the record if there is no such line
+  static idx_t MolBlockEnd(const string &record);
+
+  //! Parses the data items of the record that start at `offset`. For each
+  //! item, `callback(name, name_length)` returns the string the value of the
+  //! item is written to, or nullptr to skip the value. The lines of a value
+  //! spanning several lines are joined with newlines, as RDKit does
+  template <class CALLBACK>
+  static void ParseDataItems(const string &record, idx_t offset,
+                             CALLBACK &&callback) {
+    idx_t pos = offset;
+    idx_t line_end;
+    while (pos < record.size()) {
+      auto line_start = pos;
+      NextLine(record, pos, line_end);
+      if (record.compare(line_start, 4, "$$$$") == 0) {
+        break;
+      }
+      if (line_start == line_end || record[line_start] != '>') {
+        continue;
+      }
+      //! The name of the item is between the first pair of angle brackets of
+      //! the header line. Items without a name are skipped
+      auto name_start = record.find('<', line_start);
+      if (name_start == string::npos || name_start >= line_end) {
+        continue;
+      }
+      auto name_end = record.find('>', name_start + 1);
+      if (name_end == string::npos || name_end >= line_end) {
+        continue;
+      }
+      string *value = callback(record.data() + name_start + 1,
+                               name_end - name_start - 1);
+      if (value) {
+        value->clear();
+      }
+      //! The value is made up of the lines up to the next blank line
+      bool first_line = true;
+      while (pos < record.size()) {
+        auto value_start = pos;
+        auto next_pos = pos;
+        NextLine(record, next_pos, line_end);
+        if (IsBlank(record, value_start, line_end) ||
+            record.compare(value_start, 4, "$$$$") == 0) {
+          break;
+        }
+        if (value) {
+          if (!first_line) {
+            *value += '\n';
+          }
+          value->append(record, value_start, line_end - value_start);
+        }
+        first_line = false;
+        pos = next_pos;
+      }
+    }
+  }
+
+  //! Moves `pos` past the line starting at `pos`, and sets `line_end` to the
+  //! end of its content (without the newline and carriage return)
+  static void NextLine(const string &record, idx_t &pos, idx_t &line_end);
+  static bool IsBlank(const string &record, idx_t start, idx_t end);
+};
+
+//! What an output column of the scan holds
+enum class SDFColumnKind : uint8_t { PROPERTY, MOL, FILENAME, VIRTUAL };
+
 struct SDFScanGlobalState {
 public:
-  SDFScanGlobalState(ClientContext &context, const SDFScanData &bind_data);
+  SDFScanGlobalState(ClientContext &context, const SDFScanData &bind_data,
+                     const vector<column_t> &column_ids,
+                     optional_ptr<TableFilterSet> filters);
+
+  //! Hands out the next range to a thread. The files are handed out one
+  //! after the other, each file split into ranges of buffer_size bytes.
+  //! Returns false once all files have been handed out
+  bool ClaimRange(SDFScanRange &range);
+  //! One thread per range, but no more than fit in the memory that is left
+  //! under the memory limit, see THREAD_MEMORY
+  idx_t MaxThreads() const;
+
+  //! What a thread of the scan holds, roughly: its read buffer, a chunk of
+  //! Mol values and the molecule that is being built
+  static constexpr idx_t THREAD_MEMORY = 4 * 1024 * 1024;
 
 public:
   //! Bound data
   const SDFScanData &bind_data;
-  unique_ptr<RDKit::v2::FileParsers::SDMolSupplier> mol_supplier;
-  //! the number of records in the SDF file
-  idx_t length;
-  //! The record number of the last record we have scanned in the SDF file;
-  //! where we are in the SDF
-  idx_t offset;
+  //! The size of each file in bytes
+  vector<idx_t> file_sizes;
+  //! The size of all files together
+  idx_t total_size;
+  //! The number of ranges all files are split into
+  idx_t range_count;
+  //! The number of threads, from the ranges and the memory limit
+  idx_t max_threads;
+  //! The number of bytes over all files that have been scanned, for progress
+  //! reporting
+  std::atomic<idx_t> bytes_scanned;
 
   //! Column names that we're actually reading (after projection pushdown)
   vector<string> names;
+  //! For each output column, what it holds
+  vector<SDFColumnKind> column_kinds;
+  //! The output column of each projected property
+  std::unordered_map<string, idx_t> property_columns;
+  //! The output column of the Mol, or INVALID_INDEX if it is not projected.
+  //! The molecule is only built from the molblock when it is projected
+  idx_t mol_column = DConstants::INVALID_INDEX;
+  //! The type of each output column
+  vector<LogicalType> column_types;
+  //! The filter pushed down on each output column, if any. Records that do
+  //! not pass the filters of their properties are skipped before their
+  //! molblock is parsed
+  vector<optional_ptr<const TableFilter>> column_filters;
+  //! Whether a filter is pushed down on the Mol column
+  bool has_mol_filter = false;
+
+private:
+  mutex lock;
+  //! The index of the next range to hand out
+  idx_t next_range_idx;
+  //! The file and the offset in the file the next range starts at
+  idx_t next_file_idx;
+  idx_t next_range_start;
 };
 
 struct SDFScanLocalState {
@@ -59,13 +248,23 @@ public:
   SDFScanLocalState(ClientContext &context, SDFScanGlobalState &gstate);
 
 public:
-  //! Retrieves the next chunk of SDF records from the global state
-  //! and populates the local state with its properties.
-  //! If a molecule is available, its properties are extracted and stored in
-  //! the local state. The number of records scanned is also incremented
+  //! Retrieves the next chunk of SDF records from the range that is being
+  //! scanned by this thread, and claims a new range from the global state
+  //! once the current one is finished. A chunk only ever contains records of
+  //! a single range.
+  //! Records that do not pass the pushed down filters are skipped.
+  //! The properties of each record are read by the SDFRecordParser, and the
+  //! molecule is only built if the Mol column is projected. If the molblock
+  //! cannot be parsed, the Mol is NULL but the properties are still
+  //! returned. The records are written straight into the vectors of
+  //! `output`. The number of records scanned is also incremented
   //! accordingly, and stored in the local state.
-  void ExtractNextChunk(SDFScanGlobalState &gstate, SDFScanLocalState &lstate,
-                        SDFScanData &bind_data);
+  void ExtractNextChunk(SDFScanGlobalState &gstate, DataChunk &output);
+
+private:
+  //! Grows the reservation when a molecule is larger than the ones built
+  //! before it
+  void ReserveMolMemory(const RDKit::ROMol &mol);
 
 public:
   //! The number of records successfully scanned from the SDF.
@@ -74,15 +273,37 @@ public:
   //! know to not call the function again. That will end the scan.
   idx_t scan_count;
 
-  //! The properties for each record in the current chunk of records being
-  //! scanned. Each record is a "row", each property is a "column". The outer
-  //! vector is a vector of "rows" (the inner vector). Each entry in the inner
-  //! vector is a "column", or property extracted from the SDF fields
-  vector<vector<string>> rows;
+  //! The range this thread is currently scanning
+  SDFScanRange range;
 
 private:
   //! Bind data
   const SDFScanData &bind_data;
+  ClientContext &context;
+  FileSystem &fs;
+  //! How the Mols are built, from the settings of the connection
+  duckdb_rdkit::UmbraMolOptions mol_options;
+  //! THREAD_MEMORY plus the largest molecule built so far, reserved with
+  //! the buffer manager
+  duckdb_rdkit::RDKitMemoryReservation memory;
+  idx_t mol_memory = 0;
+  //! Each thread reads the files through its own handle, which is kept open
+  //! for as long as the thread reads ranges of the same file
+  unique_ptr<FileHandle> file_handle;
+  idx_t file_handle_idx = DConstants::INVALID_INDEX;
+  SDFRangeReader reader;
+  bool range_active = false;
+  //! The text of the record that is currently parsed
+  string record;
+  //! The value of each output column for the record that is currently
+  //! parsed, an empty string being NULL. The strings are reused from record
+  //! to record so that their memory is only allocated once per thread
+  vector<string> values;
+  //! Scratch space to look up the name of a data item
+  string item_name;
+  //! Columns of types other than VARCHAR and Mol are written as strings to
+  //! these vectors, and cast to their type once the chunk is complete
+  vector<unique_ptr<Vector>> cast_vectors;
 };
 
 struct SDFGlobalTableFunctionState : public GlobalTableFunctionState {
@@ -91,6 +312,7 @@ public:
                               TableFunctionInitInput &input);
   static unique_ptr<GlobalTableFunctionState>
   Init(ClientContext &context, TableFunctionInitInput &input);
+  idx_t MaxThreads() const override { return state.MaxThreads(); }
 
 public:
   SDFScanGlobalState state;
@@ -110,16 +332,23 @@ public:
 
 struct SDFScan {
 public:
-  //! Scans the first record of the SDF and assumes that the properties in the
-  //! first are the same for all records. Fills the bind_data names,
-  //! return_types, and types fields with these properties for the reading
-  //! function for projection
+  //! Scans the first record of each SDF and assumes that the properties in the
+  //! first record of a file are the same for all records of that file. The
+  //! molecules are not built. The schema is the union of the properties found
+  //! in all files, in the order they were first seen. Fills the bind_data
+  //! names, return_types, and types fields with these properties for the
+  //! reading function for projection
   static void AutoDetect(ClientContext &context, SDFScanData &bind_data,
                          vector<LogicalType> &return_types,
                          vector<string> &names);
   static double ScanProgress(ClientContext &context,
                              const FunctionData *bind_data_p,
                              const GlobalTableFunctionState *global_state);
+  //! The batch index of a chunk is the index of the range it was read from,
+  //! which lets duckdb preserve the order of the records in the file
+  static OperatorPartitionData
+  GetPartitionData(ClientContext &context,
+                   TableFunctionGetPartitionInput &input);
 };
 
 } // namespace duckdb
@@ -0,0 +1,13 @@
+#pragma once
+#include "duckdb/function/function_set.hpp"
+#include "duckdb/function/replacement_scan.hpp"
+namespace duckdb {
+
+class SMILESFunctions {
+public:
+  static TableFunctionSet GetReadSMILESTableFunction();
+  static unique_ptr<TableRef>
+  ReadSMILESReplacement(ClientContext &context, ReplacementScanInput &input,
+                        optional_ptr<ReplacementScanData> data);
+};
+} // namespace duckdb
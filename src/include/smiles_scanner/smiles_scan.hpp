@@ -0,0 +1,260 @@
+#pragma once
+#include "duckdb/common/file_system.hpp"
+#include "duckdb/common/multi_file/multi_file_reader.hpp"
+#include "duckdb/common/mutex.hpp"
+#include "duckdb/common/unique_ptr.hpp"
+#include "duckdb/execution/execution_context.hpp"
+#include "duckdb/function/function.hpp"
+#include "duckdb/function/table_function.hpp"
+#include "duckdb/main/client_context.hpp"
+#include "mol_formats.hpp"
+#include "rdkit_memory.hpp"
+#include "umbra_mol.hpp"
+#include <atomic>
+#include <string_view>
+
+namespace duckdb {
+
+//! The scan of SMILES files follows the parallel scan of SDFs: each file is
+//! split into byte ranges that are scanned by one thread at a time
+
+struct SMILESScanData : public TableFunctionData {
+public:
+  void Bind(ClientContext &context, TableFunctionBindInput &input);
+
+  //! The files we're reading
+  vector<string> files;
+  //! The names and types of the columns: the Mol, the name of the molecule
+  //! and, if the "filename" option is set, the file a molecule was read from
+  vector<string> names;
+  vector<LogicalType> return_types;
+
+  //! Whether the first line of each file is a header to be skipped
+  bool header = false;
+  //! The temporary table that the lines that could not be parsed are written
+  //! to, instead of being returned with a NULL Mol. Empty if not set
+  string rejects_table;
+
+  //! The size in bytes of the ranges a file is split into. Each range is
+  //! scanned by one thread at a time
+  idx_t buffer_size = DEFAULT_BUFFER_SIZE;
+  static constexpr idx_t DEFAULT_BUFFER_SIZE = 8 * 1024 * 1024;
+
+  static constexpr idx_t MOL_COLUMN = 0;
+  static constexpr idx_t NAME_COLUMN = 1;
+  static constexpr idx_t FILENAME_COLUMN = 2;
+};
+
+//! A byte range of a SMILES file that is scanned by a single thread
+struct SMILESScanRange {
+  //! The index of the range over all files, used as the batch index so that
+  //! duckdb can keep the molecules in the order they are in the files
+  idx_t range_idx;
+  //! The index of the file in the bind data
+  idx_t file_idx;
+  idx_t start;
+  idx_t end;
+};
+
+//! Reads the lines in a byte range of a SMILES file.
+//!
+//! A line belongs to the range in which it starts, so the last line of a
+//! range can extend past the end of the range, and the first bytes of a range
+//! (up to and including its first newline) belong to the previous range.
+class SMILESRangeReader {
+public:
+  //! If `skip_header` is set, the first line of the file is skipped
+  void Reset(FileHandle &handle, idx_t file_size, const SMILESScanRange &range,
+             bool skip_header);
+
+  //! Sets `line` to the next line of the range, without its newline.
+  //! Returns false when there are no lines left
+  bool NextLine(string &line, idx_t &line_start);
+
+private:
+  //! Appends the next line (including the newline) to `line`.
+  //! Returns false at the end of the file
+  bool ReadLine(string &line);
+
+  optional_ptr<FileHandle> handle;
+  idx_t file_size = 0;
+  idx_t range_end = 0;
+
+  //! The file offset of the next byte to read
+  idx_t position = 0;
+  //! Read buffer, and the file offset of its first byte
+  unsafe_unique_array<char> buffer;
+  idx_t buffer_offset = 0;
+  idx_t buffer_length = 0;
+  static constexpr idx_t READ_BUFFER_SIZE = 1024 * 1024;
+};
+
+//! Splits a line of a SMILES file into the SMILES and the name of the
+//! molecule, without building the molecule.
+//!
+//! As in the RDKit SmilesMolSupplier, the fields of a line are separated by
+//! spaces or tabs, and the name is the field after the SMILES. A CXSMILES
+//! extension ("|...|") following the SMILES is part of the SMILES.
+struct SMILESLineParser {
+  //! Returns false for blank lines
+  static bool Split(const string &line, std::string_view &smiles,
+                    std::string_view &name);
+};
+
+//! A line that could not be parsed, waiting to be written to the rejects
+//! table
+struct SMILESReject {
+  idx_t file_idx;
+  idx_t byte_offset;
+  string smiles;
+  string name;
+  string error;
+};
+
+//! What an output column of the scan holds
+enum class SMILESColumnKind : uint8_t { MOL, NAME, FILENAME, VIRTUAL };
+
+struct SMILESScanGlobalState {
+public:
+  SMILESScanGlobalState(ClientContext &context,
+                        const SMILESScanData &bind_data,
+                        const vector<column_t> &column_ids);
+
+  //! Hands out the next range to a thread. The files are handed out one
+  //! after the other, each file split into ranges of buffer_size bytes.
+  //! Returns false once all files have been handed out
+  bool ClaimRange(SMILESScanRange &range);
+  //! One thread per range, but no more than fit in the memory that is left
+  //! under the memory limit, see THREAD_MEMORY
+  idx_t MaxThreads() const;
+
+  //! What a thread of the scan holds, roughly: its read buffer, a chunk of
+  //! Mol values and the molecule that is being built
+  static constexpr idx_t THREAD_MEMORY = 4 * 1024 * 1024;
+
+  //! Writes the lines rejected by a thread to the rejects table. Threads
+  //! write the rejects of each range once they are done with it
+  void AppendRejects(ClientContext &context,
+                     const vector<SMILESReject> &rejects);
+
+public:
+  //! Bound data
+  const SMILESScanData &bind_data;
+  //! The size of each file in bytes
+  vector<idx_t> file_sizes;
+  //! The size of all files together
+  idx_t total_size;
+  //! The number of ranges all files are split into
+  idx_t range_count;
+  //! The number of threads, from the ranges and the memory limit
+  idx_t max_threads;
+  //! The number of bytes over all files that have been scanned, for progress
+  //! reporting
+  std::atomic<idx_t> bytes_scanned;
+
+  //! For each output column, what it holds
+  vector<SMILESColumnKind> column_kinds;
+  //! Whether the SMILES have to be parsed, which is the case when the Mol is
+  //! projected or when the lines that cannot be parsed are rejected
+  bool parse_mols = false;
+
+private:
+  mutex lock;
+  //! The index of the next range to hand out
+  idx_t next_range_idx;
+  //! The file and the offset in the file the next range starts at
+  idx_t next_file_idx;
+  idx_t next_range_start;
+  //! Held while appending to the rejects table
+  mutex rejects_lock;
+};
+
+struct SMILESScanLocalState {
+public:
+  SMILESScanLocalState(ClientContext &context, SMILESScanGlobalState &gstate);
+
+public:
+  //! Retrieves the next chunk of molecules from the range that is being
+  //! scanned by this thread, and claims a new range from the global state
+  //! once the current one is finished. A chunk only ever contains molecules
+  //! of a single range.
+  //! The SMILES are parsed by a parser that is kept for the whole scan. A
+  //! line that cannot be parsed is returned with a NULL Mol, or written to
+  //! the rejects table if there is one
+  void ExtractNextChunk(SMILESScanGlobalState &gstate, DataChunk &output);
+
+private:
+  //! Grows the reservation when a molecule is larger than the ones built
+  //! before it
+  void ReserveMolMemory(const RDKit::ROMol &mol);
+
+public:
+  //! The number of molecules scanned in the last call of ExtractNextChunk.
+  //! Zero signals duckdb that the scan is done
+  idx_t scan_count;
+
+  //! The range this thread is currently scanning
+  SMILESScanRange range;
+
+private:
+  //! Bind data
+  const SMILESScanData &bind_data;
+  ClientContext &context;
+  FileSystem &fs;
+  //! How the Mols are built, from the settings of the connection
+  duckdb_rdkit::UmbraMolOptions mol_options;
+  //! THREAD_MEMORY plus the largest molecule built so far, reserved with
+  //! the buffer manager
+  duckdb_rdkit::RDKitMemoryReservation memory;
+  idx_t mol_memory = 0;
+  duckdb_rdkit::SmilesMolParser parser;
+  //! Each thread reads the files through its own handle, which is kept open
+  //! for as long as the thread reads ranges of the same file
+  unique_ptr<FileHandle> file_handle;
+  idx_t file_handle_idx = DConstants::INVALID_INDEX;
+  SMILESRangeReader reader;
+  bool range_active = false;
+  //! Scratch space reused from line to line
+  string line;
+  string error;
+  //! The lines of the current range that could not be parsed
+  vector<SMILESReject> rejects;
+};
+
+struct SMILESGlobalTableFunctionState : public GlobalTableFunctionState {
+public:
+  SMILESGlobalTableFunctionState(ClientContext &context,
+                                 TableFunctionInitInput &input);
+  static unique_ptr<GlobalTableFunctionState>
+  Init(ClientContext &context, TableFunctionInitInput &input);
+  idx_t MaxThreads() const override { return state.MaxThreads(); }
+
+public:
+  SMILESScanGlobalState state;
+};
+
+struct SMILESLocalTableFunctionState : public LocalTableFunctionState {
+public:
+  SMILESLocalTableFunctionState(ClientContext &context,
+                                SMILESScanGlobalState &gstate);
+  static unique_ptr<LocalTableFunctionState>
+  Init(ExecutionContext &context, TableFunctionInitInput &input,
+       GlobalTableFunctionState *global_state);
+
+public:
+  SMILESScanLocalState state;
+};
+
+struct SMILESScan {
+public:
+  static double ScanProgress(ClientContext &context,
+                             const FunctionData *bind_data_p,
+                             const GlobalTableFunctionState *global_state);
+  //! The batch index of a chunk is the index of the range it was read from,
+  //! which lets duckdb preserve the order of the molecules in the file
+  static OperatorPartitionData
+  GetPartitionData(ClientContext &context,
+                   TableFunctionGetPartitionInput &input);
+};
+
+} // namespace duckdb
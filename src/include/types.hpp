@@ -8,5 +8,7 @@
 namespace duckdb_rdkit {
 
 LogicalType Mol();
+LogicalType Bfp();
+LogicalType QMol();
 void RegisterTypes(ExtensionLoader &loader);
 } // namespace duckdb_rdkit
@@ -9,14 +9,67 @@
 #include <GraphMol/Substruct/SubstructMatch.h>
 #include <cstdint>
 #include <cstring>
+#include <string_view>
 
 namespace duckdb_rdkit {
 
+// How the molecule is stored after the header of a Mol value
+enum class MolStorage : uint8_t {
+  // An RDKit pickle, which is the fastest to deserialize
+  PICKLE,
+  // A CXSMILES, which is several times smaller than the pickle and
+  // compresses well, but has to be parsed again, see FLAG_SMILES
+  SMILES
+};
+
+// Options for building new Mol values, read from the settings of the
+// connection that inserts them
+struct UmbraMolOptions {
+  // The number of bits of the pattern fingerprint that is stored in the
+  // header as a substructure screen. 0 means no screen is stored
+  idx_t screen_bits = 0;
+  // Whether new molecules are sanitized when they are parsed. Molecules that
+  // are not sanitized are stored without their fingerprints and hash, see
+  // umbra_mol_t::FLAG_UNSANITIZED
+  bool sanitize = true;
+  MolStorage storage = MolStorage::PICKLE;
+  // Whether a few cheap descriptors are computed when the value is built and
+  // stored in its header, see umbra_mol_t::FLAG_DESCRIPTORS. Only sanitized
+  // molecules have them
+  bool descriptors = false;
+};
+
+// The descriptors stored in the header of a Mol value with FLAG_DESCRIPTORS.
+// The functions that return them read them from there instead of
+// deserializing the molecule. The values are those of the mol_* functions,
+// in the types they return
+struct HeaderDescriptors {
+  float amw;
+  float logp;
+  uint16_t num_heavy_atoms;
+  uint16_t num_rings;
+  uint16_t hbd;
+  uint16_t hba;
+};
+static_assert(sizeof(HeaderDescriptors) == 16,
+              "HeaderDescriptors is part of the stored format");
+
+// Returns the options for new Mol values from the rdkit_* settings
+UmbraMolOptions GetUmbraMolOptions(ClientContext &context);
+
+// Registers the settings read by GetUmbraMolOptions
+void RegisterUmbraMolSettings(ExtensionLoader &loader);
+
 // This is to generate the prefix and concatenate it with the binary RDKit
 // molecule so that it can then be sent to a string_t. Return the std::string
 // because later the StringVector::AddStringOrBlob function takes a std::string,
 // not string_t.
-std::string get_umbra_mol_string(const RDKit::ROMol &mol);
+// If options.sanitize is false, `mol` is expected not to be sanitized, and is
+// stored as an unsanitized value.
+std::string get_umbra_mol_string(const RDKit::ROMol &mol,
+                                 const UmbraMolOptions &options);
+
+void PrecompileDalkeFragments();
 
 struct umbra_mol_t {
   // Use composition to add methods to the string_t
@@ -37,6 +90,47 @@ struct umbra_mol_t {
   static constexpr idx_t MAX_STRING_SIZE = NumericLimits<uint32_t>::Maximum();
   static constexpr idx_t PREFIX_BYTES = string_t::PREFIX_BYTES;
 
+  // The dalke fp is followed by a versioned header:
+  //   4 bytes  HEADER_MAGIC
+  //   1 byte   the version of the header
+  //   1 byte   flags, see FLAG_UNSANITIZED and FLAG_SMILES
+  //   2 bytes  the number of 64-bit words of the screen
+  //   8 bytes  a hash of the canonical SMILES, see make_mol_hash
+  //   n bytes  the screen, an RDKit pattern fingerprint, in the bfp word
+  //            layout. There is no screen if the number of words is 0
+  //  16 bytes  the HeaderDescriptors, only with FLAG_DESCRIPTORS
+  // and then the RDKit pickle.
+  //
+  // Version 2 of the header is version 1 with the descriptors. Values without
+  // them are still written as version 1, which older versions of the
+  // extension can read.
+  //
+  // Values written by older versions of the extension have no header, the
+  // pickle directly follows the dalke fp. Every RDKit pickle starts with
+  // PICKLE_MAGIC, which is distinct from HEADER_MAGIC, so the two layouts are
+  // told apart by the 4 bytes after the dalke fp
+  static constexpr uint32_t HEADER_MAGIC = 0x4C4F4D55; // "UMOL"
+  static constexpr uint32_t PICKLE_MAGIC = 0xDEADBEEF;
+  static constexpr uint8_t HEADER_VERSION = 1;
+  static constexpr uint8_t HEADER_VERSION_DESCRIPTORS = 2;
+  static constexpr idx_t HEADER_BYTES = DALKE_FP_PREFIX_BYTES + 16;
+  static constexpr idx_t MOL_HASH_OFFSET = DALKE_FP_PREFIX_BYTES + 8;
+  static constexpr idx_t SCREEN_WORD_BYTES = sizeof(uint64_t);
+  static constexpr idx_t DESCRIPTOR_BYTES = sizeof(HeaderDescriptors);
+
+  // The molecule was stored without being sanitized, e.g. from a trusted
+  // source of canonical SMILES. It is sanitized when it is deserialized, see
+  // rdkit_mol_from_umbra_mol. Computing the fingerprints and the hash would
+  // need a sanitized molecule, so such a value has every bit of its dalke fp
+  // set, no screen and a hash of 0, and is never ruled out by the screens
+  static constexpr uint8_t FLAG_UNSANITIZED = 0x01;
+  // The molecule is stored as a CXSMILES (without coordinates) instead of a
+  // pickle. The atoms are in the order of the canonical SMILES, and the
+  // properties and conformers of the molecule are not kept
+  static constexpr uint8_t FLAG_SMILES = 0x02;
+  // The header has the HeaderDescriptors of the molecule after the screen
+  static constexpr uint8_t FLAG_DESCRIPTORS = 0x04;
+
   // umbra_mol_t is a data type used for the duckdb_rdkit extension and it
   // is a string_t type under the hood.
   //
@@ -72,7 +166,7 @@ struct umbra_mol_t {
   //   D_ASSERT(value.ptr == buffer.GetData());
   // }
 
-  uint64_t GetDalkeFP() {
+  uint64_t GetDalkeFP() const {
     uint64_t int_fp = 0;
     std::memcpy(&int_fp, string_t_umbra_mol.GetData(), DALKE_FP_PREFIX_BYTES);
     return int_fp;
@@ -81,28 +175,140 @@ struct umbra_mol_t {
   // Return the prefix as a 4 byte int
   // Converts the underlying string_t prefix to 4 byte int to make it
   // easy to do bitwise operation
-  uint32_t GetPrefixAsInt() {
+  uint32_t GetPrefixAsInt() const {
     return Load<uint32_t>(const_data_ptr_cast(string_t_umbra_mol.GetPrefix()));
   }
 
-  const char *GetPrefix() { return string_t_umbra_mol.GetPrefix(); }
+  const char *GetPrefix() const { return string_t_umbra_mol.GetPrefix(); }
 
-  uint32_t GetBinaryMolSize() {
-    return string_t_umbra_mol.GetSize() - DALKE_FP_PREFIX_BYTES;
+  uint32_t ReadHeaderUInt32(idx_t offset) const {
+    return Load<uint32_t>(
+        const_data_ptr_cast(string_t_umbra_mol.GetData() + offset));
   }
 
-  std::string GetBinaryMol() {
-    idx_t bmol_size = string_t_umbra_mol.GetSize() - DALKE_FP_PREFIX_BYTES;
-    std::string buffer;
-    buffer.resize(bmol_size);
-    if (string_t_umbra_mol.GetData() &&
-        string_t_umbra_mol.GetSize() > DALKE_FP_PREFIX_BYTES) {
-      memcpy(&buffer[0], &string_t_umbra_mol.GetData()[DALKE_FP_PREFIX_BYTES],
-             bmol_size);
+  // Whether the value has the versioned header, as opposed to the layout of
+  // older versions of the extension
+  bool HasHeader() const {
+    return string_t_umbra_mol.GetData() &&
+           string_t_umbra_mol.GetSize() >= HEADER_BYTES &&
+           ReadHeaderUInt32(DALKE_FP_PREFIX_BYTES) == HEADER_MAGIC;
+  }
+
+  // 0 for values without a header
+  uint8_t GetHeaderVersion() const {
+    if (!HasHeader()) {
+      return 0;
+    }
+    return Load<uint8_t>(const_data_ptr_cast(string_t_umbra_mol.GetData() +
+                                             DALKE_FP_PREFIX_BYTES + 4));
+  }
+
+  // 0 for values without a header
+  uint8_t GetHeaderFlags() const {
+    if (!HasHeader()) {
+      return 0;
     }
-    return buffer;
+    return Load<uint8_t>(const_data_ptr_cast(string_t_umbra_mol.GetData() +
+                                             DALKE_FP_PREFIX_BYTES + 5));
+  }
+
+  // Whether the fingerprints and the hash of the value are those of the
+  // sanitized molecule. Values written by older versions were always
+  // sanitized
+  bool IsSanitized() const {
+    return (GetHeaderFlags() & FLAG_UNSANITIZED) == 0;
+  }
+
+  // Whether the molecule is stored as a SMILES, see FLAG_SMILES
+  bool IsSmilesPayload() const {
+    return (GetHeaderFlags() & FLAG_SMILES) != 0;
   }
 
+  idx_t GetScreenWordCount() const {
+    if (!HasHeader()) {
+      return 0;
+    }
+    idx_t word_count = Load<uint16_t>(const_data_ptr_cast(
+        string_t_umbra_mol.GetData() + DALKE_FP_PREFIX_BYTES + 6));
+    // a truncated value has no screen, rather than one that is read past
+    // the end of the value
+    if (HEADER_BYTES + word_count * SCREEN_WORD_BYTES >
+        string_t_umbra_mol.GetSize()) {
+      return 0;
+    }
+    return word_count;
+  }
+
+  // Whether the header has the descriptors of the molecule, see
+  // FLAG_DESCRIPTORS
+  bool HasDescriptors() const {
+    return (GetHeaderFlags() & FLAG_DESCRIPTORS) != 0 &&
+           GetDescriptorsOffset() + DESCRIPTOR_BYTES <=
+               string_t_umbra_mol.GetSize();
+  }
+
+  // Only valid if HasDescriptors()
+  HeaderDescriptors GetDescriptors() const {
+    HeaderDescriptors descriptors;
+    std::memcpy(&descriptors,
+                string_t_umbra_mol.GetData() + GetDescriptorsOffset(),
+                DESCRIPTOR_BYTES);
+    return descriptors;
+  }
+
+  // The hash of the canonical SMILES of the molecule. Only values with a
+  // header have one, see HasHeader
+  uint64_t GetMolHash() const {
+    return Load<uint64_t>(
+        const_data_ptr_cast(string_t_umbra_mol.GetData() + MOL_HASH_OFFSET));
+  }
+
+  // The words of the pattern fingerprint screen, see GetScreenWordCount
+  const_data_ptr_t GetScreenWords() const {
+    return const_data_ptr_cast(string_t_umbra_mol.GetData() + HEADER_BYTES);
+  }
+
+  // The offset of the descriptors in the value, right after the screen
+  idx_t GetDescriptorsOffset() const {
+    return HEADER_BYTES + GetScreenWordCount() * SCREEN_WORD_BYTES;
+  }
+
+  // The offset of the RDKit pickle in the value
+  idx_t GetBinaryMolOffset() const {
+    if (!HasHeader()) {
+      return DALKE_FP_PREFIX_BYTES;
+    }
+    if (GetHeaderFlags() & FLAG_DESCRIPTORS) {
+      return GetDescriptorsOffset() + DESCRIPTOR_BYTES;
+    }
+    return GetDescriptorsOffset();
+  }
+
+  uint32_t GetBinaryMolSize() const {
+    auto offset = GetBinaryMolOffset();
+    if (string_t_umbra_mol.GetSize() <= offset) {
+      return 0;
+    }
+    return string_t_umbra_mol.GetSize() - offset;
+  }
+
+  // Returns a view of the binary molecule which points into the underlying
+  // string_t, i.e. into duckdb's memory. Nothing is copied, so the view is
+  // only valid as long as the string_t is. This is the pickle, or the SMILES
+  // if IsSmilesPayload()
+  std::string_view GetBinaryMolView() const {
+    auto size = GetBinaryMolSize();
+    if (!string_t_umbra_mol.GetData() || size == 0) {
+      return std::string_view();
+    }
+    return std::string_view(
+        &string_t_umbra_mol.GetData()[GetBinaryMolOffset()], size);
+  }
+
+  // Returns a copy of the binary molecule. Prefer GetBinaryMolView when the
+  // molecule does not need to outlive the string_t
+  std::string GetBinaryMol() const { return std::string(GetBinaryMolView()); }
+
   idx_t GetSize() const { return string_t_umbra_mol.GetSize(); }
 
   const char *GetData() const { return string_t_umbra_mol.GetData(); }
@@ -110,4 +316,13 @@ struct umbra_mol_t {
   std::string GetString() const { return std::string(GetData(), GetSize()); }
 };
 
+// The hash of a Mol value: the stored one if the value has a header, or
+// computed from the molecule for values written by older versions and for
+// unsanitized values
+uint64_t get_mol_hash(const umbra_mol_t &umbra_mol);
+
+// The hash stored in the header of a Mol value, computed from the canonical
+// SMILES of `mol`
+uint64_t make_mol_hash(const RDKit::ROMol &mol);
+
 } // namespace duckdb_rdkit
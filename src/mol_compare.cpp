@@ -1,31 +1,314 @@
+#include "bfp.hpp"
 #include "common.hpp"
+#include "duckdb/common/exception.hpp"
+#include "duckdb/common/string_util.hpp"
 #include "duckdb/common/types/vector.hpp"
 #include "duckdb/execution/expression_executor_state.hpp"
 #include "duckdb/function/scalar_function.hpp"
+#include "duckdb/main/client_context.hpp"
+#include "duckdb/main/config.hpp"
 #include "mol_formats.hpp"
+#include "rdkit_log.hpp"
+#include "rdkit_memory.hpp"
 #include "types.hpp"
 #include "umbra_mol.hpp"
 #include <GraphMol/Descriptors/MolDescriptors.h>
+#include <GraphMol/Fingerprints/Fingerprints.h>
 #include <GraphMol/GraphMol.h>
 #include <GraphMol/MolPickler.h>
 #include <GraphMol/SmilesParse/SmilesWrite.h>
 #include <GraphMol/Substruct/SubstructMatch.h>
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
 #include <memory>
 
 namespace duckdb_rdkit {
 
+static constexpr const char *CHIRAL_SSS_SETTING = "rdkit_do_chiral_sss";
+static constexpr const char *TIMEOUT_SETTING = "rdkit_substruct_timeout_ms";
+static constexpr const char *TIMEOUT_ACTION_SETTING =
+    "rdkit_substruct_timeout_action";
+static constexpr const char *MAX_COST_SETTING = "rdkit_substruct_max_cost";
+// The default of RDKit's SubstructMatchParameters::maxMatches
+static constexpr int32_t DEFAULT_MAX_MATCHES = 1000;
+
+// A query compiled from SMARTS, for the qmol overloads of the substructure
+// functions
+struct SmartsQuery {
+  std::unique_ptr<RDKit::ROMol> mol;
+  // The pattern fingerprint of the query, for each width (in words) of the
+  // screens stored in the targets that were seen so far. The Mol values of a
+  // table usually all have the same width, so there is only one
+  std::vector<std::pair<idx_t, std::string>> screens;
+
+  // Returns the words of the pattern fingerprint of the query that is
+  // compared with the screens of word_count words
+  const std::string &GetScreen(idx_t word_count) {
+    for (auto &screen : screens) {
+      if (screen.first == word_count) {
+        return screen.second;
+      }
+    }
+    // RDKit's pattern fingerprint supports query molecules, the bits that
+    // are set are the ones that every match of the query has set
+    std::unique_ptr<ExplicitBitVect> fp(RDKit::PatternFingerprintMol(
+        *mol, word_count * umbra_mol_t::SCREEN_WORD_BYTES * 8));
+    screens.emplace_back(word_count,
+                         make_bfp_string(*fp).substr(bfp_t::HEADER_BYTES));
+    return screens.back().second;
+  }
+};
+
+// Thrown out of RDKit::SubstructMatch when a row has used up its time, see
+// CompareLocalState::CheckBudget
+struct MatchBudgetExceeded {};
+
+// Whether a row that runs out of time, or is over rdkit_substruct_max_cost,
+// is NULL ('null') or raises an error ('error', the default)
+static bool ParseTimeoutAction(const Value &parameter) {
+  auto action = StringUtil::Lower(StringValue::Get(parameter));
+  if (action == "null") {
+    return true;
+  }
+  if (action == "error") {
+    return false;
+  }
+  throw InvalidInputException("%s must be 'error' or 'null', got '%s'",
+                              TIMEOUT_ACTION_SETTING,
+                              StringValue::Get(parameter));
+}
+
+static void SetTimeoutAction(ClientContext &context, SetScope scope,
+                             Value &parameter) {
+  ParseTimeoutAction(parameter);
+}
+
+// Per-thread state for is_exact_match and the substructure functions.
+//
+// The query argument of these functions is very often a constant, e.g.
+// is_substruct(m, 'c1ccccc1'::mol), or comes from a dictionary vector where
+// the same value is repeated. Instead of unpickling the query for every row
+// that gets past the dalke fp screen, the deserialized query (and its
+// canonical SMILES for exact match) is kept here and only rebuilt when the
+// query bytes change.
+struct CompareLocalState : public FunctionLocalState {
+  // The umbra mol bytes of the query that is currently cached
+  std::string query_key;
+  std::unique_ptr<RDKit::ROMol> query_mol;
+  // Only computed when needed, i.e. for is_exact_match
+  std::string query_smiles;
+  bool has_query_smiles = false;
+  // The targets that get past the screens are deserialized into this
+  // molecule, which is reused from row to row
+  RDKit::RWMol target_mol;
+  // The memory of the query, and of the largest target so far, which is
+  // reserved with the buffer manager, see ReserveMolMemory
+  idx_t query_memory = 0;
+  idx_t target_memory = 0;
+  RDKitMemoryReservation memory;
+  // The rows of a vector that get past the screens, see ScreenTargets
+  SelectionVector candidates;
+
+  // The SMARTS of the qmol query that is currently compiled
+  std::string smarts_key;
+  SmartsQuery smarts_query;
+  // Whether substructure searches take chirality into account, from the
+  // rdkit_do_chiral_sss setting
+  bool do_chiral_match = false;
+
+  // The name of the function, and its counters since the last chunk, which
+  // are added to the totals of rdkit_stats() after every chunk
+  std::string function_name;
+  ScreenStats stats;
+
+  // The context of the query, to stop when it is interrupted
+  ClientContext *context = nullptr;
+  // The time each row may spend in RDKit::SubstructMatch in
+  // substruct_count and substruct_matches, from the
+  // rdkit_substruct_timeout_ms setting. 0 if there is no limit
+  idx_t timeout_ms = 0;
+  // Whether a row that runs out of time, or is over max_cost, is NULL
+  // instead of an error
+  bool timeout_null = false;
+  // When the current row runs out of time
+  std::chrono::steady_clock::time_point deadline;
+  // The largest number of target atoms times query atoms of a row that is
+  // matched by RDKit, from the rdkit_substruct_max_cost setting. 0 if there
+  // is no limit
+  idx_t max_cost = 0;
+
+  explicit CompareLocalState(ClientContext &context)
+      : memory(context), candidates(STANDARD_VECTOR_SIZE) {}
+
+  void FlushStats() { FlushScreenStats(function_name, stats); }
+
+  // Stops a long match when the query is interrupted. Called before every
+  // row that is matched by RDKit
+  void CheckInterrupted() const {
+    if (context->interrupted) {
+      throw InterruptException();
+    }
+  }
+
+  // Starts the time budget of the row that is matched next
+  void StartBudget() {
+    if (timeout_ms > 0) {
+      deadline = std::chrono::steady_clock::now() +
+                 std::chrono::milliseconds(timeout_ms);
+    }
+  }
+
+  // Called by RDKit for every complete mapping of the query onto the target
+  // that it finds. Throws MatchBudgetExceeded when the row has run out of
+  // time. This stops a search that finds a very large number of mappings,
+  // e.g. a generic query on a symmetric molecule. RDKit has no hook that
+  // runs while it looks for a mapping, so a search that explodes without
+  // finding one is not stopped
+  void CheckBudget() const {
+    CheckInterrupted();
+    if (std::chrono::steady_clock::now() > deadline) {
+      throw MatchBudgetExceeded();
+    }
+  }
+
+  // Handles a row that ran out of time: returns true if the row is NULL,
+  // and throws otherwise
+  bool TimedOut() const {
+    if (timeout_null) {
+      return true;
+    }
+    throw InvalidInputException(
+        "%s: a row took more than %d ms in RDKit, which is the limit set by "
+        "%s. Set %s to 'null' to return NULL for such rows",
+        function_name, timeout_ms, TIMEOUT_SETTING, TIMEOUT_ACTION_SETTING);
+  }
+
+  // Checks the cost of matching target_mol with the query before RDKit
+  // starts. The time a search takes grows with the number of ways the query
+  // atoms can be laid onto the target atoms, so this bounds the rows that
+  // the time budget cannot stop, e.g. in is_substruct and is_exact_match.
+  // Returns true if the row is over the limit and NULL, and throws if it is
+  // over the limit and such rows raise an error
+  bool OverMaxCost(const RDKit::ROMol &query_mol) const {
+    if (max_cost == 0) {
+      return false;
+    }
+    idx_t target_atoms = target_mol.getNumAtoms();
+    idx_t query_atoms = query_mol.getNumAtoms();
+    if (target_atoms * query_atoms <= max_cost) {
+      return false;
+    }
+    if (timeout_null) {
+      return true;
+    }
+    throw InvalidInputException(
+        "%s: matching a target of %d atoms with a query of %d atoms is over "
+        "the limit of %d set by %s. Set %s to 'null' to return NULL for such "
+        "rows",
+        function_name, target_atoms, query_atoms, max_cost, MAX_COST_SETTING,
+        TIMEOUT_ACTION_SETTING);
+  }
+
+  // Adds CheckBudget to the parameters of a match when there is a timeout.
+  // Only useful when the search goes on after the first mapping, i.e. with
+  // maxMatches > 1
+  void SetBudgetCheck(RDKit::SubstructMatchParameters &params) const {
+    if (timeout_ms == 0) {
+      return;
+    }
+    params.extraFinalCheck = [this](const RDKit::ROMol &,
+                                    const std::vector<unsigned int> &) {
+      CheckBudget();
+      return true;
+    };
+  }
+
+  // Called after a target was deserialized into target_mol. The reservation
+  // only grows with the largest target, as target_mol keeps its memory
+  void ReserveMolMemory() {
+    target_memory =
+        MaxValue<idx_t>(target_memory, EstimateMolMemory(target_mol));
+    memory.Resize(query_memory + target_memory);
+  }
+
+  // Returns the deserialized query molecule, only unpickling it if the
+  // query is different from the one that is currently cached
+  const RDKit::ROMol &GetQueryMol(umbra_mol_t &query) {
+    if (!query_mol || query.GetSize() != query_key.size() ||
+        memcmp(query.GetData(), query_key.data(), query_key.size()) != 0) {
+      query_key = query.GetString();
+      query_mol = rdkit_mol_from_umbra_mol(query);
+      query_smiles.clear();
+      has_query_smiles = false;
+      query_memory = EstimateMolMemory(*query_mol);
+      memory.Resize(query_memory + target_memory);
+    }
+    return *query_mol;
+  }
+
+  // Returns the compiled SMARTS query, only compiling it if the query is
+  // different from the one that is currently compiled. This happens once per
+  // thread for a constant query
+  SmartsQuery &GetSmartsQuery(const string_t &smarts) {
+    if (!smarts_query.mol || smarts.GetSize() != smarts_key.size() ||
+        memcmp(smarts.GetData(), smarts_key.data(), smarts_key.size()) != 0) {
+      smarts_key = smarts.GetString();
+      smarts_query.mol = rdkit_mol_from_smarts(smarts_key);
+      smarts_query.screens.clear();
+      query_memory = EstimateMolMemory(*smarts_query.mol);
+      memory.Resize(query_memory + target_memory);
+    }
+    return smarts_query;
+  }
+
+  const std::string &GetQuerySmiles(umbra_mol_t &query,
+                                    bool do_chiral_match) {
+    auto &mol = GetQueryMol(query);
+    if (!has_query_smiles) {
+      query_smiles = RDKit::MolToSmiles(mol, do_chiral_match);
+      has_query_smiles = true;
+    }
+    return query_smiles;
+  }
+};
+
+static unique_ptr<FunctionLocalState>
+InitCompareLocalState(ExpressionState &state,
+                      const BoundFunctionExpression &expr,
+                      FunctionData *bind_data) {
+  auto &context = state.GetContext();
+  auto result = make_uniq<CompareLocalState>(context);
+  result->function_name = expr.function.name;
+  result->context = &context;
+  Value value;
+  if (context.TryGetCurrentSetting(CHIRAL_SSS_SETTING, value) &&
+      !value.IsNull()) {
+    result->do_chiral_match = BooleanValue::Get(value);
+  }
+  if (context.TryGetCurrentSetting(TIMEOUT_SETTING, value) &&
+      !value.IsNull()) {
+    result->timeout_ms = UBigIntValue::Get(value);
+  }
+  if (context.TryGetCurrentSetting(TIMEOUT_ACTION_SETTING, value) &&
+      !value.IsNull()) {
+    result->timeout_null = ParseTimeoutAction(value);
+  }
+  if (context.TryGetCurrentSetting(MAX_COST_SETTING, value) &&
+      !value.IsNull()) {
+    result->max_cost = UBigIntValue::Get(value);
+  }
+  return std::move(result);
+}
+
 // credit: code is from chemicalite
 // https://github.com/rvianello/chemicalite
 // See mol_search.test for an example of
 // a molecule which can return false negative, if the SMILES is different from
 // the query
-bool mol_cmp(std::string m1_bmol, std::string m2_bmol) {
-  std::unique_ptr<RDKit::ROMol> m1(new RDKit::ROMol());
-  std::unique_ptr<RDKit::ROMol> m2(new RDKit::ROMol());
-
-  RDKit::MolPickler::molFromPickle(m1_bmol, *m1);
-  RDKit::MolPickler::molFromPickle(m2_bmol, *m2);
+bool mol_cmp(const RDKit::ROMol &m1, umbra_mol_t &m2_umbra_mol,
+             CompareLocalState &lstate) {
+  auto &m2 = lstate.GetQueryMol(m2_umbra_mol);
 
   // credit: code is from chemicalite
   // https://github.com/rvianello/chemicalite
@@ -33,13 +316,17 @@ bool mol_cmp(std::string m1_bmol, std::string m2_bmol) {
   // a molecule which can return false negative, if the SMILES is different
   // from the query if m1 is substruct of m2 and m2 is substruct of m1,
   // likely to be the same molecule
-  RDKit::MatchVectType matchVect;
-  bool recursion_possible = false;
-  bool do_chiral_match = false; /* FIXME: make configurable getDoChiralSSS(); */
-  bool ss1 = RDKit::SubstructMatch(*m1, *m2, matchVect, recursion_possible,
-                                   do_chiral_match);
-  bool ss2 = RDKit::SubstructMatch(*m2, *m1, matchVect, recursion_possible,
-                                   do_chiral_match);
+  // Exact match stays non-chiral: the hash in the header is made from the
+  // non-isomeric SMILES (see make_mol_hash), so a chiral compare here could
+  // reject pairs whose hashes agree and the hash pre-filter would no longer
+  // match what this function decides
+  bool do_chiral_match = false;
+  RDKit::SubstructMatchParameters params;
+  params.recursionPossible = false;
+  params.useChirality = do_chiral_match;
+  params.maxMatches = 1;
+  bool ss1 = !RDKit::SubstructMatch(m1, m2, params).empty();
+  bool ss2 = !RDKit::SubstructMatch(m2, m1, params).empty();
   if (ss1 && !ss2) {
     return false;
   } else if (!ss1 && ss2) {
@@ -47,55 +334,142 @@ bool mol_cmp(std::string m1_bmol, std::string m2_bmol) {
   }
 
   // the above can still fail in some chirality cases
-  std::string smi1 = RDKit::MolToSmiles(*m1, do_chiral_match);
-  std::string smi2 = RDKit::MolToSmiles(*m2, do_chiral_match);
+  std::string smi1 = RDKit::MolToSmiles(m1, do_chiral_match);
+  auto &smi2 = lstate.GetQuerySmiles(m2_umbra_mol, do_chiral_match);
   return smi1 == smi2;
 }
 
+// Adds the time from its construction to its destruction to the time spent
+// in RDKit of the stats
+struct RDKitTimer {
+  explicit RDKitTimer(ScreenStats &stats)
+      : stats(stats), start(std::chrono::steady_clock::now()) {}
+  ~RDKitTimer() {
+    stats.rdkit_nanos += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+  }
+
+  ScreenStats &stats;
+  std::chrono::steady_clock::time_point start;
+};
+
+// Returns false and sets is_null when the row is over
+// rdkit_substruct_max_cost
+bool _is_exact_match(umbra_mol_t left, umbra_mol_t right,
+                     CompareLocalState &lstate, bool &is_null) {
+  auto &stats = lstate.stats;
+  stats.rows++;
+  // The prefix of a umbra_mol contains a bit vector for substructure
+  // screens. We also use this to check exact match. If the molecules
+  // being compared do not have the same substructures marked by the
+  // dalke_fp, they cannot be an exact match
+  //
+  // Unsanitized values have neither a dalke fp nor a hash, so they are
+  // always compared with rdkit
+  bool sanitized = left.IsSanitized() && right.IsSanitized();
+  if (sanitized && memcmp(left.GetPrefix(), right.GetPrefix(),
+                          umbra_mol_t::PREFIX_BYTES) != 0) {
+    stats.prefix_rejected++;
+    return false;
+  };
+
+  // New values store a hash of their canonical SMILES, which is what the
+  // check with rdkit below compares in the end. The molecules are only
+  // deserialized if one of them was written by an older version
+  if (sanitized && left.HasHeader() && right.HasHeader()) {
+    if (left.GetDalkeFP() != right.GetDalkeFP()) {
+      stats.dalke_fp_rejected++;
+      return false;
+    }
+    if (left.GetMolHash() != right.GetMolHash()) {
+      stats.hash_rejected++;
+      return false;
+    }
+    stats.matches++;
+    return true;
+  }
+
+  // otherwise, do the more extensive check with rdkit
+  lstate.CheckInterrupted();
+  stats.full_match_rows++;
+  RDKitTimer timer(stats);
+  rdkit_mol_from_umbra_mol(left, lstate.target_mol);
+  lstate.ReserveMolMemory();
+  if (lstate.OverMaxCost(lstate.GetQueryMol(right))) {
+    is_null = true;
+    return false;
+  }
+  auto match = mol_cmp(lstate.target_mol, right, lstate);
+  stats.matches += match;
+  return match;
+}
+
 static void is_exact_match(DataChunk &args, ExpressionState &state,
                            Vector &result) {
   D_ASSERT(args.ColumnCount() == 2);
-  // args.data[i] is a FLAT_VECTOR
+  auto &lstate =
+      ExecuteFunctionState::GetFunctionState(state)->Cast<CompareLocalState>();
   auto &left = args.data[0];
   auto &right = args.data[1];
 
-  BinaryExecutor::Execute<string_t, string_t, bool>(
+  BinaryExecutor::ExecuteWithNulls<string_t, string_t, bool>(
       left, right, result, args.size(),
-      [&](string_t &left_umbra_blob, string_t &right_umbra_blob) {
+      [&](string_t &left_umbra_blob, string_t &right_umbra_blob,
+          ValidityMask &mask, idx_t idx) {
         auto left = umbra_mol_t(left_umbra_blob);
         auto right = umbra_mol_t(right_umbra_blob);
-
-        // The prefix of a umbra_mol contains a bit vector for substructure
-        // screens. We also use this to check exact match. If the molecules
-        // being compared do not have the same substructures marked by the
-        // dalke_fp, they cannot be an exact match
-        if (memcmp(left.GetPrefix(), right.GetPrefix(),
-                   umbra_mol_t::PREFIX_BYTES) != 0) {
-          return false;
-        };
-
-        // otherwise, do the more extensive check with rdkit
-        return mol_cmp(left.GetBinaryMol(), right.GetBinaryMol());
+        bool is_null = false;
+        auto match = _is_exact_match(left, right, lstate, is_null);
+        if (is_null) {
+          mask.SetInvalid(idx);
+        }
+        return match;
       });
+  lstate.FlushStats();
 }
 
-bool _is_substruct(umbra_mol_t target, umbra_mol_t query) {
-  // if the fragment exists in the query but not in the target,
-  // there is no way for a match. This only works in one direction
-  //
-  // If the fragment exists in the target, but not the query, it is still
-  // possible there is something in the query that matches the target, but
-  // is not captured in the dalke fingerprint
-  //
-  // If all fragments that are on in the query are also on in the target,
-  // this does not mean that the query is a substructure. It is possible
-  // that there is something in the query not captured in the fingerprint
-  // that is present in the query, but not in the target. For example,
-  // if the query has NCCCCCCCC, and the target has the N bit set,
-  // but it could be that the target is only NC
-  //
-  // It is only possible to short-circuit in the false case, not in the
-  // true case
+// Checks the pattern fingerprint screens in the headers of the molecules,
+// when both of them have one of the same width. Like the dalke fp, this can
+// only rule a match out: every bit of the query's screen has to be set in the
+// target's screen for the query to be a substructure
+static bool screen_may_match(const umbra_mol_t &target,
+                             const umbra_mol_t &query) {
+  auto word_count = query.GetScreenWordCount();
+  if (word_count == 0 || target.GetScreenWordCount() != word_count) {
+    return true;
+  }
+  return bfp_contains_words(target.GetScreenWords(), query.GetScreenWords(),
+                            word_count);
+}
+
+// Runs all screens of a target against a query. Like the screens themselves,
+// this can only rule a match out
+//
+// if the fragment exists in the query but not in the target,
+// there is no way for a match. This only works in one direction
+//
+// If the fragment exists in the target, but not the query, it is still
+// possible there is something in the query that matches the target, but
+// is not captured in the dalke fingerprint
+//
+// If all fragments that are on in the query are also on in the target,
+// this does not mean that the query is a substructure. It is possible
+// that there is something in the query not captured in the fingerprint
+// that is present in the query, but not in the target. For example,
+// if the query has NCCCCCCCC, and the target has the N bit set,
+// but it could be that the target is only NC
+//
+// It is only possible to short-circuit in the false case, not in the
+// true case
+static bool substruct_screen(const umbra_mol_t &target,
+                             const umbra_mol_t &query, ScreenStats &stats) {
+  // An unsanitized query has no fingerprints to screen with. An unsanitized
+  // target has every bit of its dalke fp set and no screen, so it always
+  // gets past the screens
+  if (!query.IsSanitized()) {
+    return true;
+  }
   auto q_prefix = query.GetPrefixAsInt();
   auto t_prefix = target.GetPrefixAsInt();
 
@@ -103,59 +477,503 @@ bool _is_substruct(umbra_mol_t target, umbra_mol_t query) {
   // If we cannot conclude that the query is NOT a substructure of the target,
   // we need the rest of the dalke fp. This requires chasing a pointer to the
   // data of which the next 4 bytes of the dalke fp is at the front of.
-  if ((q_prefix & t_prefix) == q_prefix) {
-    auto q_dalke_fp = query.GetDalkeFP();
-    auto t_dalke_fp = target.GetDalkeFP();
-    if ((q_dalke_fp & t_dalke_fp) == q_dalke_fp) {
-      // query might be substructure of the target -- run a substructure match
-      // on the molecule objects
-      std::unique_ptr<RDKit::ROMol> left_mol(new RDKit::ROMol());
-      std::unique_ptr<RDKit::ROMol> right_mol(new RDKit::ROMol());
+  if ((q_prefix & t_prefix) != q_prefix) {
+    stats.prefix_rejected++;
+    return false;
+  }
+  auto q_dalke_fp = query.GetDalkeFP();
+  if ((q_dalke_fp & target.GetDalkeFP()) != q_dalke_fp) {
+    stats.dalke_fp_rejected++;
+    return false;
+  }
+  if (!screen_may_match(target, query)) {
+    stats.screen_rejected++;
+    return false;
+  }
+  return true;
+}
+
+// Screens a vector of targets against a single query, and returns the number
+// of rows that may match, whose indexes (into the vector) are written to
+// candidates. NULL targets are never candidates.
+//
+// The screens are run one after the other over the whole vector, from the
+// cheapest to the most expensive. The first pass only reads the prefixes
+// inlined in the string_t's, which are contiguous in the vector. Only rows
+// that get past it have the rest of their dalke fp and their pattern
+// fingerprint screen read from the heap
+static idx_t ScreenTargets(const UnifiedVectorFormat &targets, idx_t count,
+                           const umbra_mol_t &query,
+                           SelectionVector &candidates, ScreenStats &stats) {
+  auto target_data = UnifiedVectorFormat::GetData<string_t>(targets);
+  // With no bits set, an unsanitized query rules nothing out, see
+  // substruct_screen
+  auto sanitized = query.IsSanitized();
+  uint32_t q_prefix = sanitized ? query.GetPrefixAsInt() : 0;
+
+  idx_t valid_count = 0;
+  idx_t candidate_count = 0;
+  for (idx_t i = 0; i < count; i++) {
+    auto idx = targets.sel->get_index(i);
+    if (!targets.validity.RowIsValid(idx)) {
+      continue;
+    }
+    valid_count++;
+    auto t_prefix = Load<uint32_t>(
+        const_data_ptr_cast(target_data[idx].GetPrefix()));
+    candidates.set_index(candidate_count, i);
+    candidate_count += (q_prefix & t_prefix) == q_prefix;
+  }
+  stats.rows += valid_count;
+  stats.prefix_rejected += valid_count - candidate_count;
+
+  uint64_t q_dalke_fp = sanitized ? query.GetDalkeFP() : 0;
+  idx_t screened_count = 0;
+  for (idx_t c = 0; c < candidate_count; c++) {
+    auto i = candidates.get_index(c);
+    auto target = umbra_mol_t(target_data[targets.sel->get_index(i)]);
+    if ((q_dalke_fp & target.GetDalkeFP()) != q_dalke_fp) {
+      stats.dalke_fp_rejected++;
+      continue;
+    }
+    if (!screen_may_match(target, query)) {
+      stats.screen_rejected++;
+      continue;
+    }
+    candidates.set_index(screened_count++, i);
+  }
+  return screened_count;
+}
 
-      RDKit::MolPickler::molFromPickle(target.GetBinaryMol(), *left_mol);
-      RDKit::MolPickler::molFromPickle(query.GetBinaryMol(), *right_mol);
+// The screen of a target against a SMARTS query. There is no dalke fp for
+// SMARTS, so only targets with a pattern fingerprint screen can be ruled out
+static bool smarts_screen(const umbra_mol_t &target, SmartsQuery &query) {
+  auto word_count = target.GetScreenWordCount();
+  if (word_count == 0) {
+    return true;
+  }
+  auto &screen = query.GetScreen(word_count);
+  return bfp_contains_words(target.GetScreenWords(),
+                            const_data_ptr_cast(screen.data()), word_count);
+}
 
-      // copied from chemicalite
-      RDKit::MatchVectType matchVect;
-      bool recursion_possible = true;
-      bool do_chiral_match =
-          false; /* FIXME: make configurable getDoChiralSSS(); */
-      return RDKit::SubstructMatch(*left_mol, *right_mol, matchVect,
-                                   recursion_possible, do_chiral_match);
+// Like ScreenTargets, for a SMARTS query
+static idx_t ScreenTargets(const UnifiedVectorFormat &targets, idx_t count,
+                           SmartsQuery &query, SelectionVector &candidates,
+                           ScreenStats &stats) {
+  auto target_data = UnifiedVectorFormat::GetData<string_t>(targets);
+  idx_t candidate_count = 0;
+  for (idx_t i = 0; i < count; i++) {
+    auto idx = targets.sel->get_index(i);
+    if (!targets.validity.RowIsValid(idx)) {
+      continue;
+    }
+    stats.rows++;
+    if (!smarts_screen(umbra_mol_t(target_data[idx]), query)) {
+      stats.screen_rejected++;
+      continue;
     }
+    candidates.set_index(candidate_count++, i);
   }
-  return false;
+  return candidate_count;
 }
 
+// Drives the substructure functions: the targets (the first argument) are
+// screened against the queries (the second argument), and
+// match(i, target_mol, query_mol) is only called for the rows i of the chunk
+// that get past the screens, in increasing order. It returns whether the
+// query matched, for the stats. The rows where the target or the query is
+// NULL, and the rows that run out of time or are over
+// rdkit_substruct_max_cost with rdkit_substruct_timeout_action = 'null', are
+// set invalid in validity.
+//
+// The common case is a constant query, e.g. is_substruct(m, 'c1ccccc1'::mol)
+// The whole vector of targets is screened against it first, and only then
+// are the remaining rows deserialized and matched. Other queries are screened
+// row by row, and only deserialized when they differ from the cached one.
+// The targets are deserialized into the same molecule for every row.
+//
+// With SMARTS, the queries are qmol values, which are compiled instead of
+// deserialized
+template <bool SMARTS, class MATCH>
+static void SubstructCandidates(DataChunk &args, idx_t count,
+                                CompareLocalState &lstate,
+                                ValidityMask &validity, MATCH &&match) {
+  auto &stats = lstate.stats;
+  // Deserializes a target that got past the screens and matches the query
+  auto match_target = [&](idx_t i, const umbra_mol_t &target,
+                          const RDKit::ROMol &query_mol) {
+    lstate.CheckInterrupted();
+    stats.full_match_rows++;
+    RDKitTimer timer(stats);
+    rdkit_mol_from_umbra_mol(target, lstate.target_mol);
+    lstate.ReserveMolMemory();
+    if (lstate.OverMaxCost(query_mol)) {
+      validity.SetInvalid(i);
+      return;
+    }
+    lstate.StartBudget();
+    try {
+      stats.matches += match(i, lstate.target_mol, query_mol);
+    } catch (MatchBudgetExceeded &) {
+      if (lstate.TimedOut()) {
+        validity.SetInvalid(i);
+      }
+    }
+  };
+  auto &left = args.data[0];
+  auto &right = args.data[1];
+  UnifiedVectorFormat targets, queries;
+  left.ToUnifiedFormat(count, targets);
+  right.ToUnifiedFormat(count, queries);
+  auto target_data = UnifiedVectorFormat::GetData<string_t>(targets);
+  auto query_data = UnifiedVectorFormat::GetData<string_t>(queries);
+
+  for (idx_t i = 0; i < count; i++) {
+    if (!targets.validity.RowIsValid(targets.sel->get_index(i)) ||
+        !queries.validity.RowIsValid(queries.sel->get_index(i))) {
+      validity.SetInvalid(i);
+    }
+  }
+
+  if (right.GetVectorType() == VectorType::CONSTANT_VECTOR) {
+    if (!queries.validity.RowIsValid(0)) {
+      return;
+    }
+    const RDKit::ROMol *query_mol;
+    idx_t candidate_count;
+    if constexpr (SMARTS) {
+      auto &query = lstate.GetSmartsQuery(query_data[0]);
+      query_mol = query.mol.get();
+      candidate_count =
+          ScreenTargets(targets, count, query, lstate.candidates, stats);
+    } else {
+      auto query = umbra_mol_t(query_data[0]);
+      query_mol = &lstate.GetQueryMol(query);
+      candidate_count =
+          ScreenTargets(targets, count, query, lstate.candidates, stats);
+    }
+    for (idx_t c = 0; c < candidate_count; c++) {
+      auto i = lstate.candidates.get_index(c);
+      auto target = umbra_mol_t(target_data[targets.sel->get_index(i)]);
+      match_target(i, target, *query_mol);
+    }
+    return;
+  }
+
+  for (idx_t i = 0; i < count; i++) {
+    if (!validity.RowIsValid(i)) {
+      continue;
+    }
+    auto target = umbra_mol_t(target_data[targets.sel->get_index(i)]);
+    auto &query_value = query_data[queries.sel->get_index(i)];
+    stats.rows++;
+    const RDKit::ROMol *query_mol;
+    if constexpr (SMARTS) {
+      auto &query = lstate.GetSmartsQuery(query_value);
+      if (!smarts_screen(target, query)) {
+        stats.screen_rejected++;
+        continue;
+      }
+      query_mol = query.mol.get();
+    } else {
+      auto query = umbra_mol_t(query_value);
+      if (!substruct_screen(target, query, stats)) {
+        continue;
+      }
+      // The query is only deserialized when it differs from the cached one
+      query_mol = &lstate.GetQueryMol(query);
+    }
+    match_target(i, target, *query_mol);
+  }
+}
+
+static RDKit::SubstructMatchParameters
+SubstructParameters(const CompareLocalState &lstate, int32_t max_matches) {
+  // copied from chemicalite
+  RDKit::SubstructMatchParameters params;
+  params.recursionPossible = true;
+  params.useChirality = lstate.do_chiral_match;
+  params.uniquify = true;
+  params.maxMatches = max_matches;
+  // With a single match the search stops at the first mapping, which is
+  // also the first time the budget could be checked
+  if (max_matches > 1) {
+    lstate.SetBudgetCheck(params);
+  }
+  return params;
+}
+
+// Rows where the functions are constant only need to be computed once
+static idx_t SubstructRowCount(DataChunk &args) {
+  return args.AllConstant() ? 1 : args.size();
+}
+
+template <bool SMARTS>
 static void is_substruct(DataChunk &args, ExpressionState &state,
                          Vector &result) {
   D_ASSERT(args.ColumnCount() == 2);
-  // args.data[i] is a FLAT_VECTOR
-  auto &left = args.data[0];
-  auto &right = args.data[1];
+  auto &lstate =
+      ExecuteFunctionState::GetFunctionState(state)->Cast<CompareLocalState>();
+  auto count = SubstructRowCount(args);
 
-  BinaryExecutor::Execute<string_t, string_t, bool>(
-      left, right, result, args.size(),
-      [&](string_t &left_umbra_blob, string_t &right_umbra_blob) {
-        auto left_umbra_mol = umbra_mol_t(left_umbra_blob);
-        auto right_umbra_mol = umbra_mol_t(right_umbra_blob);
+  result.SetVectorType(VectorType::FLAT_VECTOR);
+  auto result_data = FlatVector::GetData<bool>(result);
+  for (idx_t i = 0; i < count; i++) {
+    result_data[i] = false;
+  }
+  // The search stops at the first match
+  auto params = SubstructParameters(lstate, 1);
+  SubstructCandidates<SMARTS>(
+      args, count, lstate, FlatVector::Validity(result),
+      [&](idx_t i, const RDKit::ROMol &target_mol,
+          const RDKit::ROMol &query_mol) {
+        result_data[i] =
+            !RDKit::SubstructMatch(target_mol, query_mol, params).empty();
+        return result_data[i];
+      });
+  lstate.FlushStats();
+
+  if (args.AllConstant()) {
+    result.SetVectorType(VectorType::CONSTANT_VECTOR);
+  }
+}
+
+// The optional third argument of substruct_count and substruct_matches is the
+// number of matches after which the search stops. Returns false if it is NULL
+static bool GetMaxMatches(DataChunk &args, const UnifiedVectorFormat &data,
+                          idx_t i, int32_t &max_matches) {
+  if (args.ColumnCount() < 3) {
+    max_matches = DEFAULT_MAX_MATCHES;
+    return true;
+  }
+  auto idx = data.sel->get_index(i);
+  if (!data.validity.RowIsValid(idx)) {
+    return false;
+  }
+  max_matches = UnifiedVectorFormat::GetData<int32_t>(data)[idx];
+  if (max_matches <= 0) {
+    throw InvalidInputException("max_matches must be greater than 0, got %d",
+                                max_matches);
+  }
+  return true;
+}
+
+// substruct_count(mol, query [, max_matches]) returns the number of unique
+// matches of query in mol, counting at most max_matches of them (1000 by
+// default). The search stops as soon as max_matches are found
+template <bool SMARTS>
+static void substruct_count(DataChunk &args, ExpressionState &state,
+                            Vector &result) {
+  D_ASSERT(args.ColumnCount() == 2 || args.ColumnCount() == 3);
+  auto &lstate =
+      ExecuteFunctionState::GetFunctionState(state)->Cast<CompareLocalState>();
+  auto count = SubstructRowCount(args);
+
+  UnifiedVectorFormat max_matches_data;
+  if (args.ColumnCount() == 3) {
+    args.data[2].ToUnifiedFormat(count, max_matches_data);
+  }
 
-        return _is_substruct(left_umbra_mol, right_umbra_mol);
+  result.SetVectorType(VectorType::FLAT_VECTOR);
+  auto result_data = FlatVector::GetData<int32_t>(result);
+  auto &result_validity = FlatVector::Validity(result);
+  for (idx_t i = 0; i < count; i++) {
+    result_data[i] = 0;
+    int32_t max_matches;
+    if (!GetMaxMatches(args, max_matches_data, i, max_matches)) {
+      result_validity.SetInvalid(i);
+    }
+  }
+  SubstructCandidates<SMARTS>(
+      args, count, lstate, result_validity,
+      [&](idx_t i, const RDKit::ROMol &target_mol,
+          const RDKit::ROMol &query_mol) {
+        int32_t max_matches;
+        if (!GetMaxMatches(args, max_matches_data, i, max_matches)) {
+          return false;
+        }
+        auto params = SubstructParameters(lstate, max_matches);
+        result_data[i] =
+            RDKit::SubstructMatch(target_mol, query_mol, params).size();
+        return result_data[i] > 0;
+      });
+  lstate.FlushStats();
+
+  if (args.AllConstant()) {
+    result.SetVectorType(VectorType::CONSTANT_VECTOR);
+  }
+}
+
+// substruct_matches(mol, query [, max_matches]) returns the unique matches
+// of query in mol, at most max_matches of them (1000 by default). Each match
+// is the list of the indexes of the atoms of mol that the atoms of query are
+// mapped to, in the order of the atoms of query
+template <bool SMARTS>
+static void substruct_matches(DataChunk &args, ExpressionState &state,
+                              Vector &result) {
+  D_ASSERT(args.ColumnCount() == 2 || args.ColumnCount() == 3);
+  auto &lstate =
+      ExecuteFunctionState::GetFunctionState(state)->Cast<CompareLocalState>();
+  auto count = SubstructRowCount(args);
+
+  UnifiedVectorFormat max_matches_data;
+  if (args.ColumnCount() == 3) {
+    args.data[2].ToUnifiedFormat(count, max_matches_data);
+  }
+
+  result.SetVectorType(VectorType::FLAT_VECTOR);
+  auto list_entries = FlatVector::GetData<list_entry_t>(result);
+  auto &result_validity = FlatVector::Validity(result);
+  for (idx_t i = 0; i < count; i++) {
+    int32_t max_matches;
+    if (!GetMaxMatches(args, max_matches_data, i, max_matches)) {
+      result_validity.SetInvalid(i);
+    }
+  }
+
+  // The matches are collected first, and written out in row order once the
+  // total size of the lists is known
+  std::vector<std::vector<RDKit::MatchVectType>> row_matches(count);
+  SubstructCandidates<SMARTS>(
+      args, count, lstate, result_validity,
+      [&](idx_t i, const RDKit::ROMol &target_mol,
+          const RDKit::ROMol &query_mol) {
+        int32_t max_matches;
+        if (!GetMaxMatches(args, max_matches_data, i, max_matches)) {
+          return false;
+        }
+        auto params = SubstructParameters(lstate, max_matches);
+        row_matches[i] = RDKit::SubstructMatch(target_mol, query_mol, params);
+        return !row_matches[i].empty();
+      });
+  lstate.FlushStats();
+
+  idx_t total_matches = 0;
+  idx_t total_atoms = 0;
+  for (auto &matches : row_matches) {
+    total_matches += matches.size();
+    for (auto &match : matches) {
+      total_atoms += match.size();
+    }
+  }
+  ListVector::Reserve(result, total_matches);
+  auto &match_vector = ListVector::GetEntry(result);
+  auto match_entries = FlatVector::GetData<list_entry_t>(match_vector);
+  ListVector::Reserve(match_vector, total_atoms);
+  auto atom_data =
+      FlatVector::GetData<int32_t>(ListVector::GetEntry(match_vector));
+
+  idx_t match_offset = 0;
+  idx_t atom_offset = 0;
+  for (idx_t i = 0; i < count; i++) {
+    list_entries[i].offset = match_offset;
+    list_entries[i].length = row_matches[i].size();
+    for (auto &match : row_matches[i]) {
+      match_entries[match_offset].offset = atom_offset;
+      match_entries[match_offset].length = match.size();
+      std::sort(match.begin(), match.end());
+      for (auto &[query_atom, target_atom] : match) {
+        atom_data[atom_offset++] = target_atom;
+      }
+      match_offset++;
+    }
+  }
+  ListVector::SetListSize(match_vector, atom_offset);
+  ListVector::SetListSize(result, match_offset);
+
+  if (args.AllConstant()) {
+    result.SetVectorType(VectorType::CONSTANT_VECTOR);
+  }
+}
+
+// mol_hash(mol) returns the hash of the canonical SMILES of the molecule,
+// which is stored in the Mol value. Grouping or joining on it compares
+// molecules without deserializing them
+static void mol_hash(DataChunk &args, ExpressionState &state, Vector &result) {
+  D_ASSERT(args.ColumnCount() == 1);
+  UnaryExecutor::Execute<string_t, uint64_t>(
+      args.data[0], result, args.size(), [&](string_t b_umbra_mol) {
+        return get_mol_hash(umbra_mol_t(b_umbra_mol));
       });
 }
 
 void RegisterCompareFunctions(ExtensionLoader &loader) {
+  auto &config = DBConfig::GetConfig(loader.GetDatabaseInstance());
+  config.AddExtensionOption(
+      CHIRAL_SSS_SETTING,
+      "Whether is_substruct, substruct_count and substruct_matches take "
+      "chirality into account",
+      LogicalType::BOOLEAN, Value::BOOLEAN(false));
+  config.AddExtensionOption(
+      TIMEOUT_SETTING,
+      "Time in milliseconds that substruct_count and substruct_matches may "
+      "spend on each row in RDKit, checked at every mapping they find. 0 "
+      "sets no limit",
+      LogicalType::UBIGINT, Value::UBIGINT(0));
+  config.AddExtensionOption(
+      TIMEOUT_ACTION_SETTING,
+      "What happens to a row that exceeds rdkit_substruct_timeout_ms or "
+      "rdkit_substruct_max_cost: 'error' raises an error, 'null' returns NULL",
+      LogicalType::VARCHAR, Value("error"), SetTimeoutAction);
+  config.AddExtensionOption(
+      MAX_COST_SETTING,
+      "The largest number of target atoms times query atoms of a row that "
+      "is_exact_match and the substructure functions match in RDKit, checked "
+      "before the match starts. 0 sets no limit",
+      LogicalType::UBIGINT, Value::UBIGINT(0));
+
   ScalarFunctionSet set("is_exact_match");
   // left type and right type
-  set.AddFunction(ScalarFunction({duckdb_rdkit::Mol(), duckdb_rdkit::Mol()},
-                                 LogicalType::BOOLEAN, is_exact_match));
+  ScalarFunction is_exact_match_fun({duckdb_rdkit::Mol(), duckdb_rdkit::Mol()},
+                                    LogicalType::BOOLEAN, is_exact_match);
+  is_exact_match_fun.init_local_state = InitCompareLocalState;
+  set.AddFunction(is_exact_match_fun);
   loader.RegisterFunction(set);
 
+  // Each substructure function has an overload for Mol queries and one for
+  // qmol (SMARTS) queries, and substruct_count and substruct_matches take
+  // an optional max_matches
+  auto add_substruct_functions = [](ScalarFunctionSet &set,
+                                    const LogicalType &return_type,
+                                    scalar_function_t mol_function,
+                                    scalar_function_t smarts_function,
+                                    bool has_max_matches) {
+    ScalarFunction mol_fun({duckdb_rdkit::Mol(), duckdb_rdkit::Mol()},
+                           return_type, mol_function);
+    ScalarFunction smarts_fun({duckdb_rdkit::Mol(), duckdb_rdkit::QMol()},
+                              return_type, smarts_function);
+    for (auto fun : {mol_fun, smarts_fun}) {
+      fun.init_local_state = InitCompareLocalState;
+      set.AddFunction(fun);
+      if (has_max_matches) {
+        fun.arguments.push_back(LogicalType::INTEGER);
+        set.AddFunction(fun);
+      }
+    }
+  };
+
   ScalarFunctionSet set_is_substruct("is_substruct");
-  set_is_substruct.AddFunction(
-      ScalarFunction({duckdb_rdkit::Mol(), duckdb_rdkit::Mol()},
-                     LogicalType::BOOLEAN, is_substruct));
+  add_substruct_functions(set_is_substruct, LogicalType::BOOLEAN,
+                          is_substruct<false>, is_substruct<true>, false);
   loader.RegisterFunction(set_is_substruct);
+
+  ScalarFunctionSet set_substruct_count("substruct_count");
+  add_substruct_functions(set_substruct_count, LogicalType::INTEGER,
+                          substruct_count<false>, substruct_count<true>, true);
+  loader.RegisterFunction(set_substruct_count);
+
+  ScalarFunctionSet set_substruct_matches("substruct_matches");
+  add_substruct_functions(
+      set_substruct_matches,
+      LogicalType::LIST(LogicalType::LIST(LogicalType::INTEGER)),
+      substruct_matches<false>, substruct_matches<true>, true);
+  loader.RegisterFunction(set_substruct_matches);
+
+  ScalarFunctionSet set_mol_hash("mol_hash");
+  set_mol_hash.AddFunction(ScalarFunction({duckdb_rdkit::Mol()},
+                                          LogicalType::UBIGINT, mol_hash));
+  loader.RegisterFunction(set_mol_hash);
 }
 
 } // namespace duckdb_rdkit
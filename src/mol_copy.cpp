@@ -0,0 +1,293 @@
+#include "mol_copy.hpp"
+#include "common.hpp"
+#include "duckdb/common/file_system.hpp"
+#include "duckdb/common/mutex.hpp"
+#include "duckdb/common/string_util.hpp"
+#include "duckdb/common/types/column/column_data_collection.hpp"
+#include "duckdb/common/vector_operations/vector_operations.hpp"
+#include "duckdb/function/copy_function.hpp"
+#include "duckdb/main/client_context.hpp"
+#include "mol_formats.hpp"
+#include "types.hpp"
+#include "umbra_mol.hpp"
+#include <GraphMol/FileParsers/FileParsers.h>
+#include <GraphMol/GraphMol.h>
+
+namespace duckdb_rdkit {
+
+enum class MolFileFormat : uint8_t { SDF, SMI };
+
+// Each thread serializes its rows into a buffer of its own, which is written
+// to the file once it is this large
+static constexpr idx_t WRITE_BUFFER_SIZE = 1024 * 1024;
+
+struct MolCopyBindData : public FunctionData {
+  MolFileFormat format;
+  // The names of the columns, which are the names of the SDF data items
+  vector<string> names;
+  // The column that holds the molecules. The other columns are written as
+  // SDF data items, or as the fields after the SMILES
+  idx_t mol_column = DConstants::INVALID_INDEX;
+  // Whether a SMILES file starts with a line of column names
+  bool header = false;
+
+  unique_ptr<FunctionData> Copy() const override {
+    auto result = make_uniq<MolCopyBindData>();
+    result->format = format;
+    result->names = names;
+    result->mol_column = mol_column;
+    result->header = header;
+    return std::move(result);
+  }
+
+  bool Equals(const FunctionData &other_p) const override {
+    auto &other = other_p.Cast<MolCopyBindData>();
+    return format == other.format && names == other.names &&
+           mol_column == other.mol_column && header == other.header;
+  }
+};
+
+struct MolCopyGlobalState : public GlobalFunctionData {
+  unique_ptr<FileHandle> handle;
+  mutex lock;
+
+  // Writes serialized rows to the file, in the order of the calls
+  void Write(const std::string &data) {
+    if (data.empty()) {
+      return;
+    }
+    lock_guard<mutex> guard(lock);
+    handle->Write(const_cast<char *>(data.data()), data.size());
+  }
+};
+
+struct MolCopyLocalState : public LocalFunctionData {
+  // The rows serialized by this thread that are not written yet
+  std::string buffer;
+};
+
+// The rows of a batch, serialized by PrepareBatch and written in batch order
+// by FlushBatch
+struct MolCopyBatchData : public PreparedBatchData {
+  std::string buffer;
+};
+
+static bool IsMolType(const LogicalType &type) {
+  return type.id() == LogicalTypeId::BLOB && type.HasAlias() &&
+         StringUtil::CIEquals(type.GetAlias(), Mol().GetAlias());
+}
+
+template <MolFileFormat FORMAT>
+static unique_ptr<FunctionData>
+MolCopyBind(ClientContext &context, CopyFunctionBindInput &input,
+            const vector<string> &names, const vector<LogicalType> &sql_types) {
+  auto format_name = FORMAT == MolFileFormat::SDF ? "sdf" : "smi";
+  auto result = make_uniq<MolCopyBindData>();
+  result->format = FORMAT;
+  result->names = names;
+  for (auto &[option, values] : input.info.options) {
+    auto loption = StringUtil::Lower(option);
+    if (FORMAT == MolFileFormat::SMI && loption == "header") {
+      // HEADER without a value means true, like for CSV
+      result->header =
+          values.empty() || BooleanValue::Get(values[0].DefaultCastAs(
+                                LogicalType::BOOLEAN));
+    } else {
+      throw BinderException("Unrecognized option for COPY TO %s: \"%s\"",
+                            format_name, option);
+    }
+  }
+  for (idx_t i = 0; i < sql_types.size(); i++) {
+    if (IsMolType(sql_types[i])) {
+      result->mol_column = i;
+      break;
+    }
+  }
+  if (result->mol_column == DConstants::INVALID_INDEX) {
+    throw BinderException("COPY TO %s needs a column of type Mol",
+                          format_name);
+  }
+  return std::move(result);
+}
+
+// Serializes the rows of a chunk. The molecules are written as molblocks or
+// SMILES, and the other columns are cast to VARCHAR. Rows where the Mol is
+// NULL are skipped, and NULL values of the other columns are left out of SDF
+// records and written as empty fields of SMILES lines
+static void SerializeChunk(ClientContext &context,
+                           const MolCopyBindData &bind_data, DataChunk &input,
+                           std::string &buffer) {
+  auto count = input.size();
+  auto column_count = input.ColumnCount();
+  vector<Vector> varchar_columns;
+  vector<UnifiedVectorFormat> columns(column_count);
+  varchar_columns.reserve(column_count);
+  for (idx_t c = 0; c < column_count; c++) {
+    if (c == bind_data.mol_column ||
+        input.data[c].GetType().id() == LogicalTypeId::VARCHAR) {
+      input.data[c].ToUnifiedFormat(count, columns[c]);
+      continue;
+    }
+    varchar_columns.emplace_back(LogicalType::VARCHAR, count);
+    VectorOperations::Cast(context, input.data[c], varchar_columns.back(),
+                           count);
+    varchar_columns.back().ToUnifiedFormat(count, columns[c]);
+  }
+
+  for (idx_t row = 0; row < count; row++) {
+    auto &mol_column = columns[bind_data.mol_column];
+    auto mol_idx = mol_column.sel->get_index(row);
+    if (!mol_column.validity.RowIsValid(mol_idx)) {
+      continue;
+    }
+    auto umbra_mol = umbra_mol_t(
+        UnifiedVectorFormat::GetData<string_t>(mol_column)[mol_idx]);
+    auto mol = rdkit_mol_from_umbra_mol(umbra_mol);
+    if (bind_data.format == MolFileFormat::SDF) {
+      buffer += RDKit::MolToMolBlock(*mol);
+    } else {
+      buffer += rdkit_mol_to_smiles(*mol);
+    }
+
+    for (idx_t c = 0; c < column_count; c++) {
+      if (c == bind_data.mol_column) {
+        continue;
+      }
+      auto idx = columns[c].sel->get_index(row);
+      auto valid = columns[c].validity.RowIsValid(idx);
+      if (bind_data.format == MolFileFormat::SDF) {
+        if (!valid) {
+          continue;
+        }
+        buffer += ">  <";
+        buffer += bind_data.names[c];
+        buffer += ">\n";
+      } else {
+        buffer += ' ';
+      }
+      if (valid) {
+        auto value = UnifiedVectorFormat::GetData<string_t>(columns[c])[idx];
+        buffer.append(value.GetData(), value.GetSize());
+      }
+      if (bind_data.format == MolFileFormat::SDF) {
+        buffer += "\n\n";
+      }
+    }
+    buffer += bind_data.format == MolFileFormat::SDF ? "$$$$\n" : "\n";
+  }
+}
+
+static unique_ptr<GlobalFunctionData>
+MolCopyInitGlobal(ClientContext &context, FunctionData &bind_data_p,
+                  const string &file_path) {
+  auto &bind_data = bind_data_p.Cast<MolCopyBindData>();
+  auto &fs = FileSystem::GetFileSystem(context);
+  auto result = make_uniq<MolCopyGlobalState>();
+  result->handle =
+      fs.OpenFile(file_path, FileFlags::FILE_FLAGS_WRITE |
+                                 FileFlags::FILE_FLAGS_FILE_CREATE_NEW |
+                                 FileLockType::WRITE_LOCK);
+  if (bind_data.header) {
+    std::string header = "SMILES";
+    for (idx_t c = 0; c < bind_data.names.size(); c++) {
+      if (c != bind_data.mol_column) {
+        header += ' ' + bind_data.names[c];
+      }
+    }
+    result->Write(header + '\n');
+  }
+  return std::move(result);
+}
+
+static unique_ptr<LocalFunctionData>
+MolCopyInitLocal(ExecutionContext &context, FunctionData &bind_data) {
+  return make_uniq<MolCopyLocalState>();
+}
+
+// Without an order to keep, every thread serializes its chunks into its own
+// buffer, and writes the buffer whenever it is full
+static void MolCopySink(ExecutionContext &context, FunctionData &bind_data,
+                        GlobalFunctionData &gstate_p,
+                        LocalFunctionData &lstate_p, DataChunk &input) {
+  auto &gstate = gstate_p.Cast<MolCopyGlobalState>();
+  auto &lstate = lstate_p.Cast<MolCopyLocalState>();
+  SerializeChunk(context.client, bind_data.Cast<MolCopyBindData>(), input,
+                 lstate.buffer);
+  if (lstate.buffer.size() >= WRITE_BUFFER_SIZE) {
+    gstate.Write(lstate.buffer);
+    lstate.buffer.clear();
+  }
+}
+
+static void MolCopyCombine(ExecutionContext &context, FunctionData &bind_data,
+                           GlobalFunctionData &gstate_p,
+                           LocalFunctionData &lstate_p) {
+  auto &gstate = gstate_p.Cast<MolCopyGlobalState>();
+  auto &lstate = lstate_p.Cast<MolCopyLocalState>();
+  gstate.Write(lstate.buffer);
+  lstate.buffer.clear();
+}
+
+static void MolCopyFinalize(ClientContext &context, FunctionData &bind_data,
+                            GlobalFunctionData &gstate_p) {
+  auto &gstate = gstate_p.Cast<MolCopyGlobalState>();
+  gstate.handle->Close();
+}
+
+// When the order of the rows is kept, the batches are serialized in parallel
+// and written in batch order
+static unique_ptr<PreparedBatchData>
+MolCopyPrepareBatch(ClientContext &context, FunctionData &bind_data,
+                    GlobalFunctionData &gstate,
+                    unique_ptr<ColumnDataCollection> collection) {
+  auto result = make_uniq<MolCopyBatchData>();
+  for (auto &chunk : collection->Chunks()) {
+    SerializeChunk(context, bind_data.Cast<MolCopyBindData>(), chunk,
+                   result->buffer);
+  }
+  return std::move(result);
+}
+
+static void MolCopyFlushBatch(ClientContext &context, FunctionData &bind_data,
+                              GlobalFunctionData &gstate_p,
+                              PreparedBatchData &batch_p) {
+  auto &gstate = gstate_p.Cast<MolCopyGlobalState>();
+  auto &batch = batch_p.Cast<MolCopyBatchData>();
+  gstate.Write(batch.buffer);
+  batch.buffer.clear();
+}
+
+static CopyFunctionExecutionMode
+MolCopyExecutionMode(bool preserve_insertion_order,
+                     bool supports_batch_index) {
+  if (!preserve_insertion_order) {
+    return CopyFunctionExecutionMode::PARALLEL_COPY_TO_FILE;
+  }
+  if (supports_batch_index) {
+    return CopyFunctionExecutionMode::BATCH_COPY_TO_FILE;
+  }
+  return CopyFunctionExecutionMode::REGULAR_COPY_TO_FILE;
+}
+
+template <MolFileFormat FORMAT>
+static CopyFunction GetMolCopyFunction(const string &name) {
+  CopyFunction function(name);
+  function.copy_to_bind = MolCopyBind<FORMAT>;
+  function.copy_to_initialize_global = MolCopyInitGlobal;
+  function.copy_to_initialize_local = MolCopyInitLocal;
+  function.copy_to_sink = MolCopySink;
+  function.copy_to_combine = MolCopyCombine;
+  function.copy_to_finalize = MolCopyFinalize;
+  function.execution_mode = MolCopyExecutionMode;
+  function.prepare_batch = MolCopyPrepareBatch;
+  function.flush_batch = MolCopyFlushBatch;
+  function.extension = name;
+  return function;
+}
+
+void RegisterCopyFunctions(ExtensionLoader &loader) {
+  loader.RegisterFunction(GetMolCopyFunction<MolFileFormat::SDF>("sdf"));
+  loader.RegisterFunction(GetMolCopyFunction<MolFileFormat::SMI>("smi"));
+}
+
+} // namespace duckdb_rdkit
@@ -6,12 +6,16 @@
 #include "duckdb/common/types/value.hpp"
 #include "duckdb/common/types/vector.hpp"
 #include "duckdb/common/vector_operations/unary_executor.hpp"
+#include "duckdb/execution/expression_executor.hpp"
 #include "duckdb/execution/expression_executor_state.hpp"
 #include "duckdb/function/function_set.hpp"
+#include "duckdb/planner/expression/bound_function_expression.hpp"
 #include "mol_formats.hpp"
 #include "qed.hpp"
 #include "types.hpp"
 #include "umbra_mol.hpp"
+#include <algorithm>
+#include <optional>
 
 namespace duckdb_rdkit {
 
@@ -19,14 +23,18 @@ void mol_logp(DataChunk &args, ExpressionState &state, Vector &result) {
   D_ASSERT(args.data.size() == 1);
   auto &binary_umbra_mol = args.data[0];
   auto count = args.size();
+  auto &cache = GetMolCache(state.GetContext());
 
   UnaryExecutor::Execute<string_t, float>(
-      binary_umbra_mol, result, count, [&](string_t b_umbra_mol) {
+      binary_umbra_mol, result, count,
+      [&](string_t b_umbra_mol) -> float {
         auto umbra_mol = umbra_mol_t(b_umbra_mol);
-        auto bmol = umbra_mol.GetBinaryMol();
-        auto mol = rdkit_binary_mol_to_mol(bmol);
+        if (umbra_mol.HasDescriptors()) {
+          return umbra_mol.GetDescriptors().logp;
+        }
+        auto &mol = cache.Get(umbra_mol);
         double logp, _;
-        RDKit::Descriptors::calcCrippenDescriptors(*mol, logp, _);
+        RDKit::Descriptors::calcCrippenDescriptors(mol, logp, _);
         return logp;
       });
 }
@@ -35,14 +43,13 @@ void mol_qed(DataChunk &args, ExpressionState &state, Vector &result) {
   D_ASSERT(args.data.size() == 1);
   auto &binary_umbra_mol = args.data[0];
   auto count = args.size();
+  auto &cache = GetMolCache(state.GetContext());
 
   UnaryExecutor::Execute<string_t, float>(
       binary_umbra_mol, result, count, [&](string_t b_umbra_mol) {
         auto umbra_mol = umbra_mol_t(b_umbra_mol);
-        auto bmol = umbra_mol.GetBinaryMol();
-        auto mol = rdkit_binary_mol_to_mol(bmol);
-        auto qed = QED();
-        return qed.CalcQED(*mol);
+        auto &mol = cache.Get(umbra_mol);
+        return QED::Get().CalcQED(mol);
       });
 }
 
@@ -50,13 +57,17 @@ void mol_amw(DataChunk &args, ExpressionState &state, Vector &result) {
   D_ASSERT(args.data.size() == 1);
   auto &binary_umbra_mol = args.data[0];
   auto count = args.size();
+  auto &cache = GetMolCache(state.GetContext());
 
   UnaryExecutor::Execute<string_t, float>(
-      binary_umbra_mol, result, count, [&](string_t b_umbra_mol) {
+      binary_umbra_mol, result, count,
+      [&](string_t b_umbra_mol) -> float {
         auto umbra_mol = umbra_mol_t(b_umbra_mol);
-        auto bmol = umbra_mol.GetBinaryMol();
-        auto mol = rdkit_binary_mol_to_mol(bmol);
-        return RDKit::Descriptors::calcAMW(*mol);
+        if (umbra_mol.HasDescriptors()) {
+          return umbra_mol.GetDescriptors().amw;
+        }
+        auto &mol = cache.Get(umbra_mol);
+        return RDKit::Descriptors::calcAMW(mol);
       });
 }
 
@@ -64,13 +75,13 @@ void mol_exactmw(DataChunk &args, ExpressionState &state, Vector &result) {
   D_ASSERT(args.data.size() == 1);
   auto &binary_umbra_mol = args.data[0];
   auto count = args.size();
+  auto &cache = GetMolCache(state.GetContext());
 
   UnaryExecutor::Execute<string_t, float>(
       binary_umbra_mol, result, count, [&](string_t b_umbra_mol) {
         auto umbra_mol = umbra_mol_t(b_umbra_mol);
-        auto bmol = umbra_mol.GetBinaryMol();
-        auto mol = rdkit_binary_mol_to_mol(bmol);
-        return RDKit::Descriptors::calcExactMW(*mol);
+        auto &mol = cache.Get(umbra_mol);
+        return RDKit::Descriptors::calcExactMW(mol);
       });
 }
 
@@ -78,13 +89,13 @@ void mol_tpsa(DataChunk &args, ExpressionState &state, Vector &result) {
   D_ASSERT(args.data.size() == 1);
   auto &binary_umbra_mol = args.data[0];
   auto count = args.size();
+  auto &cache = GetMolCache(state.GetContext());
 
   UnaryExecutor::Execute<string_t, float>(
       binary_umbra_mol, result, count, [&](string_t b_umbra_mol) {
         auto umbra_mol = umbra_mol_t(b_umbra_mol);
-        auto bmol = umbra_mol.GetBinaryMol();
-        auto mol = rdkit_binary_mol_to_mol(bmol);
-        return RDKit::Descriptors::calcTPSA(*mol);
+        auto &mol = cache.Get(umbra_mol);
+        return RDKit::Descriptors::calcTPSA(mol);
       });
 }
 
@@ -92,13 +103,17 @@ void mol_hbd(DataChunk &args, ExpressionState &state, Vector &result) {
   D_ASSERT(args.data.size() == 1);
   auto &binary_umbra_mol = args.data[0];
   auto count = args.size();
+  auto &cache = GetMolCache(state.GetContext());
 
   UnaryExecutor::Execute<string_t, int32_t>(
-      binary_umbra_mol, result, count, [&](string_t b_umbra_mol) {
+      binary_umbra_mol, result, count,
+      [&](string_t b_umbra_mol) -> int32_t {
         auto umbra_mol = umbra_mol_t(b_umbra_mol);
-        auto bmol = umbra_mol.GetBinaryMol();
-        auto mol = rdkit_binary_mol_to_mol(bmol);
-        return RDKit::Descriptors::calcNumHBD(*mol);
+        if (umbra_mol.HasDescriptors()) {
+          return umbra_mol.GetDescriptors().hbd;
+        }
+        auto &mol = cache.Get(umbra_mol);
+        return RDKit::Descriptors::calcNumHBD(mol);
       });
 }
 
@@ -106,13 +121,17 @@ void mol_hba(DataChunk &args, ExpressionState &state, Vector &result) {
   D_ASSERT(args.data.size() == 1);
   auto &binary_umbra_mol = args.data[0];
   auto count = args.size();
+  auto &cache = GetMolCache(state.GetContext());
 
   UnaryExecutor::Execute<string_t, int32_t>(
-      binary_umbra_mol, result, count, [&](string_t b_umbra_mol) {
+      binary_umbra_mol, result, count,
+      [&](string_t b_umbra_mol) -> int32_t {
         auto umbra_mol = umbra_mol_t(b_umbra_mol);
-        auto bmol = umbra_mol.GetBinaryMol();
-        auto mol = rdkit_binary_mol_to_mol(bmol);
-        return RDKit::Descriptors::calcNumHBA(*mol);
+        if (umbra_mol.HasDescriptors()) {
+          return umbra_mol.GetDescriptors().hba;
+        }
+        auto &mol = cache.Get(umbra_mol);
+        return RDKit::Descriptors::calcNumHBA(mol);
       });
 }
 
@@ -120,16 +139,334 @@ void mol_num_rotatable_bonds(DataChunk &args, ExpressionState &state, Vector &re
   D_ASSERT(args.data.size() == 1);
   auto &binary_umbra_mol = args.data[0];
   auto count = args.size();
+  auto &cache = GetMolCache(state.GetContext());
 
   UnaryExecutor::Execute<string_t, int32_t>(
       binary_umbra_mol, result, count, [&](string_t b_umbra_mol) {
         auto umbra_mol = umbra_mol_t(b_umbra_mol);
-        auto bmol = umbra_mol.GetBinaryMol();
-        auto mol = rdkit_binary_mol_to_mol(bmol);
-        return RDKit::Descriptors::calcNumRotatableBonds(*mol);
+        auto &mol = cache.Get(umbra_mol);
+        return RDKit::Descriptors::calcNumRotatableBonds(mol);
+      });
+}
+
+void mol_num_heavy_atoms(DataChunk &args, ExpressionState &state,
+                         Vector &result) {
+  D_ASSERT(args.data.size() == 1);
+  auto &binary_umbra_mol = args.data[0];
+  auto count = args.size();
+  auto &cache = GetMolCache(state.GetContext());
+
+  UnaryExecutor::Execute<string_t, int32_t>(
+      binary_umbra_mol, result, count,
+      [&](string_t b_umbra_mol) -> int32_t {
+        auto umbra_mol = umbra_mol_t(b_umbra_mol);
+        if (umbra_mol.HasDescriptors()) {
+          return umbra_mol.GetDescriptors().num_heavy_atoms;
+        }
+        auto &mol = cache.Get(umbra_mol);
+        return mol.getNumHeavyAtoms();
+      });
+}
+
+void mol_num_rings(DataChunk &args, ExpressionState &state, Vector &result) {
+  D_ASSERT(args.data.size() == 1);
+  auto &binary_umbra_mol = args.data[0];
+  auto count = args.size();
+  auto &cache = GetMolCache(state.GetContext());
+
+  UnaryExecutor::Execute<string_t, int32_t>(
+      binary_umbra_mol, result, count,
+      [&](string_t b_umbra_mol) -> int32_t {
+        auto umbra_mol = umbra_mol_t(b_umbra_mol);
+        if (umbra_mol.HasDescriptors()) {
+          return umbra_mol.GetDescriptors().num_rings;
+        }
+        auto &mol = cache.Get(umbra_mol);
+        return RDKit::Descriptors::calcNumRings(mol);
       });
 }
 
+// Computes the descriptors of a single molecule. Each descriptor is computed
+// at most once, and intermediate results that several descriptors need are
+// shared. This is used by mol_descriptors, where the molecule is deserialized
+// once and any subset of the descriptors is computed from it. The descriptors
+// that are stored in the header of the value are read from there, and the
+// molecule is not deserialized at all if only those are needed.
+class DescriptorCalculator {
+public:
+  DescriptorCalculator(MolCache &cache, const umbra_mol_t &umbra_mol)
+      : cache(cache), umbra_mol(umbra_mol) {
+    if (umbra_mol.HasDescriptors()) {
+      header = umbra_mol.GetDescriptors();
+    }
+  }
+
+  double AMW() {
+    if (header) {
+      return header->amw;
+    }
+    return Memoize(amw, [&] { return RDKit::Descriptors::calcAMW(Mol()); });
+  }
+  double ExactMW() {
+    return Memoize(exactmw,
+                   [&] { return RDKit::Descriptors::calcExactMW(Mol()); });
+  }
+  double TPSA() {
+    return Memoize(tpsa,
+                   [&] { return RDKit::Descriptors::calcTPSA(Mol()); });
+  }
+  double LogP() {
+    if (header) {
+      return header->logp;
+    }
+    ComputeCrippen();
+    return logp;
+  }
+  double Qed() {
+    return Memoize(qed, [&] { return (double)QED::Get().CalcQED(Mol()); });
+  }
+  int32_t HBD() {
+    if (header) {
+      return header->hbd;
+    }
+    return Memoize(hbd, [&] {
+      return (int32_t)RDKit::Descriptors::calcNumHBD(Mol());
+    });
+  }
+  int32_t HBA() {
+    if (header) {
+      return header->hba;
+    }
+    return Memoize(hba, [&] {
+      return (int32_t)RDKit::Descriptors::calcNumHBA(Mol());
+    });
+  }
+  int32_t NumRotatableBonds() {
+    return Memoize(rotb, [&] {
+      return (int32_t)RDKit::Descriptors::calcNumRotatableBonds(Mol());
+    });
+  }
+  int32_t NumHeavyAtoms() {
+    if (header) {
+      return header->num_heavy_atoms;
+    }
+    return Mol().getNumHeavyAtoms();
+  }
+  int32_t NumRings() {
+    if (header) {
+      return header->num_rings;
+    }
+    return RDKit::Descriptors::calcNumRings(Mol());
+  }
+
+private:
+  template <class T, class FUNC>
+  static T Memoize(std::optional<T> &value, FUNC compute) {
+    if (!value) {
+      value = compute();
+    }
+    return *value;
+  }
+
+  // The molecule is only deserialized, or taken from the cache, once a
+  // descriptor needs it
+  const RDKit::ROMol &Mol() {
+    if (!mol) {
+      mol = &cache.Get(umbra_mol);
+    }
+    return *mol;
+  }
+
+  // logp and mr are computed together by RDKit
+  void ComputeCrippen() {
+    if (!has_crippen) {
+      RDKit::Descriptors::calcCrippenDescriptors(Mol(), logp, mr);
+      has_crippen = true;
+    }
+  }
+
+  MolCache &cache;
+  const umbra_mol_t &umbra_mol;
+  const RDKit::ROMol *mol = nullptr;
+  std::optional<HeaderDescriptors> header;
+  std::optional<double> amw, exactmw, tpsa, qed;
+  std::optional<int32_t> hbd, hba, rotb;
+  bool has_crippen = false;
+  double logp = 0, mr = 0;
+};
+
+struct DescriptorInfo {
+  // The name of the field in the STRUCT returned by mol_descriptors
+  const char *name;
+  LogicalTypeId type;
+  // Writes the descriptor for row `row` into the (flat) result vector
+  void (*compute)(DescriptorCalculator &calc, Vector &result, idx_t row);
+};
+
+// The descriptors that mol_descriptors can compute. The types match the
+// types returned by the corresponding mol_* functions
+static const DescriptorInfo descriptor_infos[] = {
+    {"amw", LogicalTypeId::FLOAT,
+     [](DescriptorCalculator &calc, Vector &result, idx_t row) {
+       FlatVector::GetData<float>(result)[row] = calc.AMW();
+     }},
+    {"exactmw", LogicalTypeId::FLOAT,
+     [](DescriptorCalculator &calc, Vector &result, idx_t row) {
+       FlatVector::GetData<float>(result)[row] = calc.ExactMW();
+     }},
+    {"tpsa", LogicalTypeId::FLOAT,
+     [](DescriptorCalculator &calc, Vector &result, idx_t row) {
+       FlatVector::GetData<float>(result)[row] = calc.TPSA();
+     }},
+    {"qed", LogicalTypeId::FLOAT,
+     [](DescriptorCalculator &calc, Vector &result, idx_t row) {
+       FlatVector::GetData<float>(result)[row] = calc.Qed();
+     }},
+    {"logp", LogicalTypeId::FLOAT,
+     [](DescriptorCalculator &calc, Vector &result, idx_t row) {
+       FlatVector::GetData<float>(result)[row] = calc.LogP();
+     }},
+    {"hbd", LogicalTypeId::INTEGER,
+     [](DescriptorCalculator &calc, Vector &result, idx_t row) {
+       FlatVector::GetData<int32_t>(result)[row] = calc.HBD();
+     }},
+    {"hba", LogicalTypeId::INTEGER,
+     [](DescriptorCalculator &calc, Vector &result, idx_t row) {
+       FlatVector::GetData<int32_t>(result)[row] = calc.HBA();
+     }},
+    {"num_rotatable_bonds", LogicalTypeId::INTEGER,
+     [](DescriptorCalculator &calc, Vector &result, idx_t row) {
+       FlatVector::GetData<int32_t>(result)[row] = calc.NumRotatableBonds();
+     }},
+    {"num_heavy_atoms", LogicalTypeId::INTEGER,
+     [](DescriptorCalculator &calc, Vector &result, idx_t row) {
+       FlatVector::GetData<int32_t>(result)[row] = calc.NumHeavyAtoms();
+     }},
+    {"num_rings", LogicalTypeId::INTEGER,
+     [](DescriptorCalculator &calc, Vector &result, idx_t row) {
+       FlatVector::GetData<int32_t>(result)[row] = calc.NumRings();
+     }},
+};
+
+static constexpr idx_t DESCRIPTOR_COUNT =
+    sizeof(descriptor_infos) / sizeof(descriptor_infos[0]);
+
+struct DescriptorsBindData : public FunctionData {
+  explicit DescriptorsBindData(vector<idx_t> descriptors_p)
+      : descriptors(std::move(descriptors_p)) {}
+
+  //! Indexes into descriptor_infos, in the order of the STRUCT fields
+  vector<idx_t> descriptors;
+
+  unique_ptr<FunctionData> Copy() const override {
+    return make_uniq<DescriptorsBindData>(descriptors);
+  }
+
+  bool Equals(const FunctionData &other_p) const override {
+    auto &other = other_p.Cast<DescriptorsBindData>();
+    return descriptors == other.descriptors;
+  }
+};
+
+static unique_ptr<FunctionData>
+MolDescriptorsBind(ClientContext &context, ScalarFunction &bound_function,
+                   vector<unique_ptr<Expression>> &arguments) {
+  vector<idx_t> descriptors;
+  if (arguments.size() == 1) {
+    // no names given, compute all of them
+    for (idx_t i = 0; i < DESCRIPTOR_COUNT; i++) {
+      descriptors.push_back(i);
+    }
+  } else {
+    // The names determine the return type, so they need to be known now
+    if (!arguments[1]->IsFoldable()) {
+      throw BinderException(
+          "mol_descriptors: the list of descriptor names must be a constant");
+    }
+    auto names = ExpressionExecutor::EvaluateScalar(context, *arguments[1]);
+    if (names.IsNull()) {
+      throw BinderException(
+          "mol_descriptors: the list of descriptor names cannot be NULL");
+    }
+    for (auto &name : ListValue::GetChildren(names)) {
+      if (name.IsNull()) {
+        throw BinderException(
+            "mol_descriptors: descriptor names cannot be NULL");
+      }
+      auto &str = StringValue::Get(name);
+      idx_t found = DESCRIPTOR_COUNT;
+      for (idx_t i = 0; i < DESCRIPTOR_COUNT; i++) {
+        if (StringUtil::CIEquals(str, descriptor_infos[i].name)) {
+          found = i;
+          break;
+        }
+      }
+      if (found == DESCRIPTOR_COUNT) {
+        vector<string> supported;
+        for (auto &info : descriptor_infos) {
+          supported.push_back(info.name);
+        }
+        throw BinderException(
+            "mol_descriptors: unknown descriptor \"%s\". Supported "
+            "descriptors are: %s",
+            str, StringUtil::Join(supported, ", "));
+      }
+      if (std::find(descriptors.begin(), descriptors.end(), found) !=
+          descriptors.end()) {
+        throw BinderException(
+            "mol_descriptors: descriptor \"%s\" is requested more than once",
+            str);
+      }
+      descriptors.push_back(found);
+    }
+    if (descriptors.empty()) {
+      throw BinderException(
+          "mol_descriptors: at least one descriptor name is required");
+    }
+  }
+
+  child_list_t<LogicalType> struct_children;
+  for (auto idx : descriptors) {
+    struct_children.emplace_back(descriptor_infos[idx].name,
+                                 LogicalType(descriptor_infos[idx].type));
+  }
+  bound_function.return_type = LogicalType::STRUCT(std::move(struct_children));
+  return make_uniq<DescriptorsBindData>(std::move(descriptors));
+}
+
+void mol_descriptors(DataChunk &args, ExpressionState &state, Vector &result) {
+  auto &func_expr = state.expr.Cast<BoundFunctionExpression>();
+  auto &bind_data = func_expr.bind_info->Cast<DescriptorsBindData>();
+  auto count = args.size();
+  auto &cache = GetMolCache(state.GetContext());
+
+  UnifiedVectorFormat mol_data;
+  args.data[0].ToUnifiedFormat(count, mol_data);
+  auto mols = UnifiedVectorFormat::GetData<string_t>(mol_data);
+  auto &children = StructVector::GetEntries(result);
+
+  for (idx_t i = 0; i < count; i++) {
+    auto idx = mol_data.sel->get_index(i);
+    if (!mol_data.validity.RowIsValid(idx)) {
+      FlatVector::SetNull(result, i, true);
+      continue;
+    }
+    auto b_umbra_mol = mols[idx];
+    auto umbra_mol = umbra_mol_t(b_umbra_mol);
+    // the molecule is deserialized only once for all of the descriptors, and
+    // not at all if another function has already deserialized it or if the
+    // descriptors are stored in the header
+    DescriptorCalculator calc(cache, umbra_mol);
+    for (idx_t c = 0; c < bind_data.descriptors.size(); c++) {
+      descriptor_infos[bind_data.descriptors[c]].compute(calc, *children[c], i);
+    }
+  }
+
+  if (args.AllConstant()) {
+    result.SetVectorType(VectorType::CONSTANT_VECTOR);
+  }
+}
+
 void RegisterDescriptorFunctions(ExtensionLoader &loader) {
   ScalarFunctionSet set_mol_amw("mol_amw");
   set_mol_amw.AddFunction(
@@ -170,5 +507,24 @@ void RegisterDescriptorFunctions(ExtensionLoader &loader) {
   set_mol_num_rotatable_bonds.AddFunction(
       ScalarFunction({duckdb_rdkit::Mol()}, LogicalType::INTEGER, mol_num_rotatable_bonds));
   loader.RegisterFunction(set_mol_num_rotatable_bonds);
+
+  ScalarFunctionSet set_mol_num_heavy_atoms("mol_num_heavy_atoms");
+  set_mol_num_heavy_atoms.AddFunction(ScalarFunction(
+      {duckdb_rdkit::Mol()}, LogicalType::INTEGER, mol_num_heavy_atoms));
+  loader.RegisterFunction(set_mol_num_heavy_atoms);
+
+  ScalarFunctionSet set_mol_num_rings("mol_num_rings");
+  set_mol_num_rings.AddFunction(ScalarFunction(
+      {duckdb_rdkit::Mol()}, LogicalType::INTEGER, mol_num_rings));
+  loader.RegisterFunction(set_mol_num_rings);
+
+  ScalarFunctionSet set_mol_descriptors("mol_descriptors");
+  set_mol_descriptors.AddFunction(
+      ScalarFunction({duckdb_rdkit::Mol()}, LogicalTypeId::STRUCT,
+                     mol_descriptors, MolDescriptorsBind));
+  set_mol_descriptors.AddFunction(ScalarFunction(
+      {duckdb_rdkit::Mol(), LogicalType::LIST(LogicalType::VARCHAR)},
+      LogicalTypeId::STRUCT, mol_descriptors, MolDescriptorsBind));
+  loader.RegisterFunction(set_mol_descriptors);
 }
 } // namespace duckdb_rdkit
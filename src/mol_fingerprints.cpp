@@ -0,0 +1,357 @@
+#include "mol_fingerprints.hpp"
+#include "bfp.hpp"
+#include "common.hpp"
+#include "duckdb/common/types/vector.hpp"
+#include "duckdb/common/vector_operations/binary_executor.hpp"
+#include "duckdb/common/vector_operations/ternary_executor.hpp"
+#include "duckdb/common/vector_operations/unary_executor.hpp"
+#include "duckdb/execution/expression_executor_state.hpp"
+#include "duckdb/function/scalar_function.hpp"
+#include "mol_formats.hpp"
+#include "types.hpp"
+#include "umbra_mol.hpp"
+#include <GraphMol/Fingerprints/Fingerprints.h>
+#include <GraphMol/Fingerprints/MACCS.h>
+#include <GraphMol/Fingerprints/MorganFingerprints.h>
+#include <memory>
+
+namespace duckdb_rdkit {
+
+static constexpr int32_t DEFAULT_MORGAN_RADIUS = 2;
+static constexpr int32_t DEFAULT_FP_SIZE = 2048;
+// Bounds the size of a single fingerprint value
+static constexpr int32_t MAX_FP_SIZE = 1 << 20;
+
+static void CheckFingerprintSize(int32_t nbits) {
+  if (nbits <= 0 || nbits > MAX_FP_SIZE) {
+    throw InvalidInputException(
+        "fingerprint size must be between 1 and %d bits, got %d", MAX_FP_SIZE,
+        nbits);
+  }
+}
+
+static string_t MorganFingerprint(MolCache &cache, string_t b_umbra_mol,
+                                  int32_t radius, int32_t nbits,
+                                  Vector &result) {
+  if (radius < 0) {
+    throw InvalidInputException("morganbv_fp radius must not be negative");
+  }
+  CheckFingerprintSize(nbits);
+  auto umbra_mol = umbra_mol_t(b_umbra_mol);
+  auto &mol = cache.Get(umbra_mol);
+  std::unique_ptr<ExplicitBitVect> fp(
+      RDKit::MorganFingerprints::getFingerprintAsBitVect(mol, radius, nbits));
+  return StringVector::AddStringOrBlob(result, make_bfp_string(*fp));
+}
+
+void morganbv_fp(DataChunk &args, ExpressionState &state, Vector &result) {
+  auto count = args.size();
+  auto &cache = GetMolCache(state.GetContext());
+  if (args.ColumnCount() == 1) {
+    UnaryExecutor::Execute<string_t, string_t>(
+        args.data[0], result, count, [&](string_t b_umbra_mol) {
+          return MorganFingerprint(cache, b_umbra_mol, DEFAULT_MORGAN_RADIUS,
+                                   DEFAULT_FP_SIZE, result);
+        });
+  } else if (args.ColumnCount() == 2) {
+    BinaryExecutor::Execute<string_t, int32_t, string_t>(
+        args.data[0], args.data[1], result, count,
+        [&](string_t b_umbra_mol, int32_t radius) {
+          return MorganFingerprint(cache, b_umbra_mol, radius,
+                                   DEFAULT_FP_SIZE, result);
+        });
+  } else {
+    D_ASSERT(args.ColumnCount() == 3);
+    TernaryExecutor::Execute<string_t, int32_t, int32_t, string_t>(
+        args.data[0], args.data[1], args.data[2], result, count,
+        [&](string_t b_umbra_mol, int32_t radius, int32_t nbits) {
+          return MorganFingerprint(cache, b_umbra_mol, radius, nbits, result);
+        });
+  }
+}
+
+static string_t RDKitFingerprint(MolCache &cache, string_t b_umbra_mol,
+                                 int32_t nbits, Vector &result) {
+  CheckFingerprintSize(nbits);
+  auto umbra_mol = umbra_mol_t(b_umbra_mol);
+  auto &mol = cache.Get(umbra_mol);
+  std::unique_ptr<ExplicitBitVect> fp(
+      RDKit::RDKFingerprintMol(mol, 1, 7, nbits));
+  return StringVector::AddStringOrBlob(result, make_bfp_string(*fp));
+}
+
+void rdkit_fp(DataChunk &args, ExpressionState &state, Vector &result) {
+  auto count = args.size();
+  auto &cache = GetMolCache(state.GetContext());
+  if (args.ColumnCount() == 1) {
+    UnaryExecutor::Execute<string_t, string_t>(
+        args.data[0], result, count, [&](string_t b_umbra_mol) {
+          return RDKitFingerprint(cache, b_umbra_mol, DEFAULT_FP_SIZE, result);
+        });
+  } else {
+    D_ASSERT(args.ColumnCount() == 2);
+    BinaryExecutor::Execute<string_t, int32_t, string_t>(
+        args.data[0], args.data[1], result, count,
+        [&](string_t b_umbra_mol, int32_t nbits) {
+          return RDKitFingerprint(cache, b_umbra_mol, nbits, result);
+        });
+  }
+}
+
+void maccs_fp(DataChunk &args, ExpressionState &state, Vector &result) {
+  D_ASSERT(args.data.size() == 1);
+  auto &cache = GetMolCache(state.GetContext());
+  UnaryExecutor::Execute<string_t, string_t>(
+      args.data[0], result, args.size(), [&](string_t b_umbra_mol) {
+        auto umbra_mol = umbra_mol_t(b_umbra_mol);
+        auto &mol = cache.Get(umbra_mol);
+        std::unique_ptr<ExplicitBitVect> fp(
+            RDKit::MACCSFingerprints::getFingerprintAsBitVect(mol));
+        return StringVector::AddStringOrBlob(result, make_bfp_string(*fp));
+      });
+}
+
+static string_t PatternFingerprint(MolCache &cache, string_t b_umbra_mol,
+                                   int32_t nbits, Vector &result) {
+  CheckFingerprintSize(nbits);
+  auto umbra_mol = umbra_mol_t(b_umbra_mol);
+  auto &mol = cache.Get(umbra_mol);
+  std::unique_ptr<ExplicitBitVect> fp(
+      RDKit::PatternFingerprintMol(mol, nbits));
+  return StringVector::AddStringOrBlob(result, make_bfp_string(*fp));
+}
+
+// The pattern fingerprint is RDKit's substructure screen: if a query is a
+// substructure of a target, every bit of the query's fingerprint is set in
+// the target's. It is much wider than the dalke fp in the Mol prefix, so it
+// screens out many more targets, and stored in a column it is computed once
+// for a table instead of for every search
+void pattern_fp(DataChunk &args, ExpressionState &state, Vector &result) {
+  auto count = args.size();
+  auto &cache = GetMolCache(state.GetContext());
+  if (args.ColumnCount() == 1) {
+    UnaryExecutor::Execute<string_t, string_t>(
+        args.data[0], result, count, [&](string_t b_umbra_mol) {
+          return PatternFingerprint(cache, b_umbra_mol, DEFAULT_FP_SIZE,
+                                    result);
+        });
+  } else {
+    D_ASSERT(args.ColumnCount() == 2);
+    BinaryExecutor::Execute<string_t, int32_t, string_t>(
+        args.data[0], args.data[1], result, count,
+        [&](string_t b_umbra_mol, int32_t nbits) {
+          return PatternFingerprint(cache, b_umbra_mol, nbits, result);
+        });
+  }
+}
+
+void bfp_popcount(DataChunk &args, ExpressionState &state, Vector &result) {
+  D_ASSERT(args.data.size() == 1);
+  UnaryExecutor::Execute<string_t, int32_t>(
+      args.data[0], result, args.size(), [&](string_t b_bfp) {
+        auto fp = bfp_t(b_bfp);
+        fp.Verify();
+        return (int32_t)fp.GetPopcount();
+      });
+}
+
+// Runs a similarity function over whole vectors.
+//
+// Instead of building an RDKit ExplicitBitVect per row, the similarity is
+// computed straight from the bfp values in duckdb's memory: the popcounts of
+// both fingerprints are stored in their headers, so only the popcount of the
+// intersection has to be computed. The query fingerprint (the second
+// argument) is usually a constant, in which case it is verified once, and its
+// words stay in cache for the whole vector.
+template <class SIMILARITY>
+static void BfpSimilarity(DataChunk &args, Vector &result,
+                          SIMILARITY &&similarity) {
+  auto count = args.size();
+  auto &left = args.data[0];
+  auto &right = args.data[1];
+
+  UnifiedVectorFormat left_data, right_data;
+  left.ToUnifiedFormat(count, left_data);
+  right.ToUnifiedFormat(count, right_data);
+  auto lefts = UnifiedVectorFormat::GetData<string_t>(left_data);
+  auto rights = UnifiedVectorFormat::GetData<string_t>(right_data);
+
+  result.SetVectorType(VectorType::FLAT_VECTOR);
+  auto result_data = FlatVector::GetData<double>(result);
+  auto &result_validity = FlatVector::Validity(result);
+
+  bool constant_query = right.GetVectorType() == VectorType::CONSTANT_VECTOR;
+  if (constant_query && right_data.validity.RowIsValid(0)) {
+    bfp_t(rights[0]).Verify();
+  }
+
+  for (idx_t i = 0; i < count; i++) {
+    auto l_idx = left_data.sel->get_index(i);
+    auto r_idx = right_data.sel->get_index(i);
+    if (!left_data.validity.RowIsValid(l_idx) ||
+        !right_data.validity.RowIsValid(r_idx)) {
+      result_validity.SetInvalid(i);
+      continue;
+    }
+    auto target = bfp_t(lefts[l_idx]);
+    auto query = bfp_t(rights[r_idx]);
+    target.Verify();
+    if (!constant_query) {
+      query.Verify();
+    }
+    if (target.GetNumBits() != query.GetNumBits()) {
+      throw InvalidInputException(
+          "cannot compare bfp fingerprints of different sizes (%d and %d "
+          "bits)",
+          target.GetNumBits(), query.GetNumBits());
+    }
+    auto common = bfp_intersect_popcount(target.GetWords(), query.GetWords(),
+                                         target.GetWordCount());
+    result_data[i] =
+        similarity(target.GetPopcount(), query.GetPopcount(), common, i);
+  }
+
+  if (args.AllConstant()) {
+    result.SetVectorType(VectorType::CONSTANT_VECTOR);
+  }
+}
+
+void tanimoto_sml_function(DataChunk &args, ExpressionState &state,
+                           Vector &result) {
+  D_ASSERT(args.ColumnCount() == 2);
+  BfpSimilarity(args, result,
+                [](uint32_t a, uint32_t b, uint64_t common, idx_t) {
+                  return tanimoto_sml(a, b, common);
+                });
+}
+
+void dice_sml_function(DataChunk &args, ExpressionState &state,
+                       Vector &result) {
+  D_ASSERT(args.ColumnCount() == 2);
+  BfpSimilarity(args, result,
+                [](uint32_t a, uint32_t b, uint64_t common, idx_t) {
+                  return dice_sml(a, b, common);
+                });
+}
+
+void tversky_sml_function(DataChunk &args, ExpressionState &state,
+                          Vector &result) {
+  D_ASSERT(args.ColumnCount() == 4);
+  auto count = args.size();
+  UnifiedVectorFormat alpha_data, beta_data;
+  args.data[2].ToUnifiedFormat(count, alpha_data);
+  args.data[3].ToUnifiedFormat(count, beta_data);
+  auto alphas = UnifiedVectorFormat::GetData<double>(alpha_data);
+  auto betas = UnifiedVectorFormat::GetData<double>(beta_data);
+
+  BfpSimilarity(args, result,
+                [&](uint32_t a, uint32_t b, uint64_t common, idx_t i) {
+                  auto alpha_idx = alpha_data.sel->get_index(i);
+                  auto beta_idx = beta_data.sel->get_index(i);
+                  if (!alpha_data.validity.RowIsValid(alpha_idx) ||
+                      !beta_data.validity.RowIsValid(beta_idx)) {
+                    throw InvalidInputException(
+                        "tversky_sml weights cannot be NULL");
+                  }
+                  return tversky_sml(a, b, common, alphas[alpha_idx],
+                                     betas[beta_idx]);
+                });
+}
+
+// bfp_contains(fp, query) is true if every bit that is set in query is also
+// set in fp. A target with fewer bits set than the query cannot contain it,
+// which is checked on the popcounts in the inlined prefixes before the words
+// are read
+void bfp_contains(DataChunk &args, ExpressionState &state, Vector &result) {
+  D_ASSERT(args.ColumnCount() == 2);
+  auto &left = args.data[0];
+  auto &right = args.data[1];
+  if (right.GetVectorType() == VectorType::CONSTANT_VECTOR &&
+      !ConstantVector::IsNull(right)) {
+    bfp_t(*ConstantVector::GetData<string_t>(right)).Verify();
+  }
+  BinaryExecutor::Execute<string_t, string_t, bool>(
+      left, right, result, args.size(), [&](string_t b_fp, string_t b_query) {
+        auto fp = bfp_t(b_fp);
+        auto query = bfp_t(b_query);
+        if (fp.GetPopcount() < query.GetPopcount()) {
+          return false;
+        }
+        fp.Verify();
+        query.Verify();
+        if (fp.GetNumBits() != query.GetNumBits()) {
+          throw InvalidInputException(
+              "cannot compare bfp fingerprints of different sizes (%d and %d "
+              "bits)",
+              fp.GetNumBits(), query.GetNumBits());
+        }
+        return bfp_contains_words(fp.GetWords(), query.GetWords(),
+                                  fp.GetWordCount());
+      });
+}
+
+void RegisterFingerprintFunctions(ExtensionLoader &loader) {
+  ScalarFunctionSet set_morganbv_fp("morganbv_fp");
+  set_morganbv_fp.AddFunction(
+      ScalarFunction({duckdb_rdkit::Mol()}, duckdb_rdkit::Bfp(), morganbv_fp));
+  set_morganbv_fp.AddFunction(ScalarFunction(
+      {duckdb_rdkit::Mol(), LogicalType::INTEGER}, duckdb_rdkit::Bfp(),
+      morganbv_fp));
+  set_morganbv_fp.AddFunction(ScalarFunction(
+      {duckdb_rdkit::Mol(), LogicalType::INTEGER, LogicalType::INTEGER},
+      duckdb_rdkit::Bfp(), morganbv_fp));
+  loader.RegisterFunction(set_morganbv_fp);
+
+  ScalarFunctionSet set_rdkit_fp("rdkit_fp");
+  set_rdkit_fp.AddFunction(
+      ScalarFunction({duckdb_rdkit::Mol()}, duckdb_rdkit::Bfp(), rdkit_fp));
+  set_rdkit_fp.AddFunction(
+      ScalarFunction({duckdb_rdkit::Mol(), LogicalType::INTEGER},
+                     duckdb_rdkit::Bfp(), rdkit_fp));
+  loader.RegisterFunction(set_rdkit_fp);
+
+  ScalarFunctionSet set_maccs_fp("maccs_fp");
+  set_maccs_fp.AddFunction(
+      ScalarFunction({duckdb_rdkit::Mol()}, duckdb_rdkit::Bfp(), maccs_fp));
+  loader.RegisterFunction(set_maccs_fp);
+
+  ScalarFunctionSet set_pattern_fp("pattern_fp");
+  set_pattern_fp.AddFunction(
+      ScalarFunction({duckdb_rdkit::Mol()}, duckdb_rdkit::Bfp(), pattern_fp));
+  set_pattern_fp.AddFunction(
+      ScalarFunction({duckdb_rdkit::Mol(), LogicalType::INTEGER},
+                     duckdb_rdkit::Bfp(), pattern_fp));
+  loader.RegisterFunction(set_pattern_fp);
+
+  ScalarFunctionSet set_bfp_popcount("bfp_popcount");
+  set_bfp_popcount.AddFunction(ScalarFunction(
+      {duckdb_rdkit::Bfp()}, LogicalType::INTEGER, bfp_popcount));
+  loader.RegisterFunction(set_bfp_popcount);
+
+  ScalarFunctionSet set_bfp_contains("bfp_contains");
+  set_bfp_contains.AddFunction(
+      ScalarFunction({duckdb_rdkit::Bfp(), duckdb_rdkit::Bfp()},
+                     LogicalType::BOOLEAN, bfp_contains));
+  loader.RegisterFunction(set_bfp_contains);
+
+  ScalarFunctionSet set_tanimoto_sml("tanimoto_sml");
+  set_tanimoto_sml.AddFunction(
+      ScalarFunction({duckdb_rdkit::Bfp(), duckdb_rdkit::Bfp()},
+                     LogicalType::DOUBLE, tanimoto_sml_function));
+  loader.RegisterFunction(set_tanimoto_sml);
+
+  ScalarFunctionSet set_dice_sml("dice_sml");
+  set_dice_sml.AddFunction(
+      ScalarFunction({duckdb_rdkit::Bfp(), duckdb_rdkit::Bfp()},
+                     LogicalType::DOUBLE, dice_sml_function));
+  loader.RegisterFunction(set_dice_sml);
+
+  ScalarFunctionSet set_tversky_sml("tversky_sml");
+  set_tversky_sml.AddFunction(ScalarFunction(
+      {duckdb_rdkit::Bfp(), duckdb_rdkit::Bfp(), LogicalType::DOUBLE,
+       LogicalType::DOUBLE},
+      LogicalType::DOUBLE, tversky_sml_function));
+  loader.RegisterFunction(set_tversky_sml);
+}
+
+} // namespace duckdb_rdkit
@@ -2,22 +2,62 @@
 #include "common.hpp"
 #include "duckdb/common/string_util.hpp"
 #include "duckdb/common/types.hpp"
+#include "duckdb/common/types/hash.hpp"
 #include "duckdb/execution/expression_executor_state.hpp"
 #include "duckdb/function/function_set.hpp"
+#include "duckdb/main/client_context.hpp"
+#include "duckdb/main/config.hpp"
 #include "types.hpp"
 #include "umbra_mol.hpp"
 #include <GraphMol/Descriptors/MolDescriptors.h>
 #include <GraphMol/FileParsers/FileParsers.h>
 #include <GraphMol/GraphMol.h>
+#include <GraphMol/MolOps.h>
 #include <GraphMol/MolPickler.h>
+#include <GraphMol/SanitException.h>
 #include <GraphMol/SmilesParse/SmartsWrite.h>
 #include <GraphMol/SmilesParse/SmilesParse.h>
 #include <GraphMol/SmilesParse/SmilesWrite.h>
+#include <istream>
+#include <streambuf>
 
 namespace duckdb_rdkit {
+
+// A read-only stream buffer over memory that is owned elsewhere, e.g. by a
+// duckdb vector. This lets RDKit read a pickle without it first being copied
+// into a std::string (and then again into a std::stringstream by RDKit)
+class PickleStreamBuf : public std::streambuf {
+public:
+  PickleStreamBuf(const char *data, size_t size) {
+    auto begin = const_cast<char *>(data);
+    setg(begin, begin, begin + size);
+  }
+
+protected:
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                   std::ios_base::openmode which) override {
+    char *target;
+    if (dir == std::ios_base::beg) {
+      target = eback() + off;
+    } else if (dir == std::ios_base::cur) {
+      target = gptr() + off;
+    } else {
+      target = egptr() + off;
+    }
+    if (target < eback() || target > egptr()) {
+      return pos_type(off_type(-1));
+    }
+    setg(eback(), target, egptr());
+    return pos_type(target - eback());
+  }
+
+  pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+    return seekoff(off_type(pos), std::ios_base::beg, which);
+  }
+};
+
 // Expects a SMILES string and returns a RDKit pickled molecule
-std::unique_ptr<RDKit::ROMol> rdkit_mol_from_smiles(std::string s) {
-  std::string smiles = s;
+std::unique_ptr<RDKit::ROMol> rdkit_mol_from_smiles(const std::string &smiles) {
   std::unique_ptr<RDKit::ROMol> mol;
   try {
     mol.reset(RDKit::SmilesToMol(smiles));
@@ -34,8 +74,51 @@ std::unique_ptr<RDKit::ROMol> rdkit_mol_from_smiles(std::string s) {
   }
 }
 
+std::unique_ptr<RDKit::RWMol> SmilesMolParser::Parse(std::string_view smiles,
+                                                     bool sanitize,
+                                                     std::string &error) {
+  buffer.assign(smiles.data(), smiles.size());
+  // As in RDKit's SmilesToMol, hydrogens are only removed when sanitizing
+  params.sanitize = sanitize;
+  params.removeHs = sanitize;
+  std::unique_ptr<RDKit::RWMol> mol;
+  try {
+    // Syntax errors are reported by returning nullptr. Only molecules that
+    // were parsed but cannot be sanitized get as far as throwing
+    mol.reset(RDKit::SmilesToMol(buffer, params));
+    if (mol && !sanitize) {
+      // The valences are needed to pickle the molecule, and this is where
+      // most invalid input is caught
+      mol->updatePropertyCache(true);
+    }
+  } catch (const RDKit::MolSanitizeException &e) {
+    error = e.what();
+    return nullptr;
+  } catch (const std::exception &e) {
+    error = e.what();
+    return nullptr;
+  }
+  if (!mol) {
+    error = "SMILES Parse Error";
+  }
+  return mol;
+}
+
+std::unique_ptr<RDKit::ROMol> rdkit_mol_from_smarts(const std::string &smarts) {
+  std::unique_ptr<RDKit::ROMol> mol;
+  try {
+    mol.reset(RDKit::SmartsToMol(smarts));
+  } catch (std::exception &e) {
+    mol.reset();
+  }
+  if (!mol) {
+    throw InvalidInputException("Could not convert %s to qmol", smarts);
+  }
+  return mol;
+}
+
 // Serialize a molecule to binary using RDKit's MolPickler
-std::string rdkit_mol_to_binary_mol(const RDKit::ROMol mol) {
+std::string rdkit_mol_to_binary_mol(const RDKit::ROMol &mol) {
   std::string buf;
   try {
     RDKit::MolPickler::pickleMol(mol, buf);
@@ -47,49 +130,296 @@ std::string rdkit_mol_to_binary_mol(const RDKit::ROMol mol) {
 }
 
 // Deserialize a binary mol to RDKit mol
-std::unique_ptr<RDKit::ROMol> rdkit_binary_mol_to_mol(std::string bmol) {
+std::unique_ptr<RDKit::ROMol> rdkit_binary_mol_to_mol(std::string_view bmol) {
+  PickleStreamBuf buf(bmol.data(), bmol.size());
+  std::istream stream(&buf);
+
   std::unique_ptr<RDKit::ROMol> mol(new RDKit::ROMol());
-  RDKit::MolPickler::molFromPickle(bmol, *mol);
+  RDKit::MolPickler::molFromPickle(stream, *mol);
 
   return mol;
 }
 
-std::string rdkit_mol_to_smiles(RDKit::ROMol mol) {
-  std::string smiles = RDKit::MolToSmiles(mol);
-  return smiles;
+void rdkit_binary_mol_to_mol(std::string_view bmol, RDKit::RWMol &mol) {
+  PickleStreamBuf buf(bmol.data(), bmol.size());
+  std::istream stream(&buf);
+
+  mol.clear();
+  RDKit::MolPickler::molFromPickle(stream, mol);
+}
+
+// Parses the SMILES stored in a Mol value with FLAG_SMILES. It is always
+// sanitized, which also sanitizes the values stored without sanitization
+static std::unique_ptr<RDKit::RWMol>
+rdkit_mol_from_stored_smiles(std::string_view smiles) {
+  std::unique_ptr<RDKit::RWMol> mol;
+  try {
+    mol.reset(RDKit::SmilesToMol(std::string(smiles)));
+  } catch (const std::exception &e) {
+    throw InvalidInputException("Could not read the SMILES of Mol: %s",
+                                e.what());
+  }
+  if (!mol) {
+    throw InvalidInputException("Could not read the SMILES of Mol");
+  }
+  return mol;
+}
+
+std::unique_ptr<RDKit::ROMol> rdkit_mol_from_umbra_mol(const umbra_mol_t &m) {
+  if (m.IsSmilesPayload()) {
+    return rdkit_mol_from_stored_smiles(m.GetBinaryMolView());
+  }
+  if (m.IsSanitized()) {
+    return rdkit_binary_mol_to_mol(m.GetBinaryMolView());
+  }
+  auto mol = std::make_unique<RDKit::RWMol>();
+  rdkit_mol_from_umbra_mol(m, *mol);
+  return mol;
+}
+
+void rdkit_mol_from_umbra_mol(const umbra_mol_t &m, RDKit::RWMol &mol) {
+  if (m.IsSmilesPayload()) {
+    mol = *rdkit_mol_from_stored_smiles(m.GetBinaryMolView());
+    return;
+  }
+  rdkit_binary_mol_to_mol(m.GetBinaryMolView(), mol);
+  if (m.IsSanitized()) {
+    return;
+  }
+  try {
+    RDKit::MolOps::sanitizeMol(mol);
+  } catch (const RDKit::MolSanitizeException &e) {
+    throw InvalidInputException("Could not sanitize Mol: %s", e.what());
+  }
+}
+
+static constexpr const char *MOL_CACHE_SIZE_SETTING = "rdkit_mol_cache_size";
+
+const RDKit::ROMol &MolCache::Get(const umbra_mol_t &m) {
+  if (capacity == 0) {
+    rdkit_mol_from_umbra_mol(m, uncached);
+    uncached_memory =
+        MaxValue<idx_t>(uncached_memory, EstimateMolMemory(uncached));
+    Reserve();
+    return uncached;
+  }
+  auto hash = Hash(m.GetData(), m.GetSize());
+  auto found = index.find(hash);
+  if (found != index.end()) {
+    auto &entry = *found->second;
+    if (entry.key.size() == m.GetSize() &&
+        memcmp(entry.key.data(), m.GetData(), m.GetSize()) == 0) {
+      entries.splice(entries.begin(), entries, found->second);
+      return *entry.mol;
+    }
+    // Another value with the same hash, which this one replaces
+    cached_memory -= entry.memory;
+    entries.erase(found->second);
+    index.erase(found);
+  }
+  auto mol = rdkit_mol_from_umbra_mol(m);
+  auto entry_memory = EstimateMolMemory(*mol) + m.GetSize();
+  entries.push_front(Entry{hash, m.GetString(), std::move(mol), entry_memory});
+  index[hash] = entries.begin();
+  cached_memory += entry_memory;
+  SetCapacity(capacity);
+  return *entries.front().mol;
+}
+
+void MolCache::EvictLast() {
+  cached_memory -= entries.back().memory;
+  index.erase(entries.back().hash);
+  entries.pop_back();
+}
+
+void MolCache::Reserve() {
+  while (true) {
+    try {
+      memory.Resize(cached_memory + uncached_memory);
+      return;
+    } catch (OutOfMemoryException &) {
+      // The molecule that was just added is at the front, and is needed by
+      // the caller
+      if (entries.size() <= 1) {
+        throw;
+      }
+      EvictLast();
+    }
+  }
+}
+
+void MolCache::SetCapacity(idx_t capacity_p) {
+  capacity = capacity_p;
+  while (entries.size() > capacity) {
+    EvictLast();
+  }
+  Reserve();
+}
+
+void MolCache::SetDatabase(ClientContext &context) {
+  try {
+    memory.SetDatabase(context);
+  } catch (OutOfMemoryException &) {
+    // The molecules cached for the queries of another database do not fit
+    // under the memory limit of this one
+    while (!entries.empty()) {
+      EvictLast();
+    }
+    Reserve();
+  }
+}
+
+MolCache &GetMolCache(ClientContext &context) {
+  thread_local MolCache cache;
+  Value value;
+  idx_t capacity = 0;
+  if (context.TryGetCurrentSetting(MOL_CACHE_SIZE_SETTING, value) &&
+      !value.IsNull()) {
+    capacity = UBigIntValue::Get(value);
+  }
+  cache.SetDatabase(context);
+  cache.SetCapacity(capacity);
+  return cache;
+}
+
+std::string rdkit_mol_to_smiles(const RDKit::ROMol &mol) {
+  return RDKit::MolToSmiles(mol);
+}
+
+// Adds the canonical SMILES of a Mol value to the string heap of target
+static string_t AddMolSmiles(string_t b_umbra_mol, Vector &target,
+                             MolCache *cache) {
+  // The input is a string_t coming from the duckdb internals, which holds
+  // the bytes of a umbra_mol_t
+  auto umbra_mol = umbra_mol_t(b_umbra_mol);
+  if (cache) {
+    return StringVector::AddString(target,
+                                   rdkit_mol_to_smiles(cache->Get(umbra_mol)));
+  }
+  auto mol = rdkit_mol_from_umbra_mol(umbra_mol);
+  return StringVector::AddString(target, rdkit_mol_to_smiles(*mol));
+}
+
+void MolVectorToSmiles(Vector &source, Vector &result, idx_t count,
+                       MolCache *cache) {
+  if (source.GetVectorType() != VectorType::DICTIONARY_VECTOR ||
+      DictionaryVector::Child(source).GetVectorType() !=
+          VectorType::FLAT_VECTOR) {
+    // The executor already computes a constant vector once
+    UnaryExecutor::Execute<string_t, string_t>(
+        source, result, count, [&](string_t b_umbra_mol) {
+          return AddMolSmiles(b_umbra_mol, result, cache);
+        });
+    return;
+  }
+
+  auto &dictionary = DictionaryVector::Child(source);
+  auto &sel = DictionaryVector::SelVector(source);
+  auto dictionary_data = FlatVector::GetData<string_t>(dictionary);
+  auto &dictionary_validity = FlatVector::Validity(dictionary);
+
+  // The SMILES of the dictionary entries that are used, in the order they
+  // are first used, and for each entry its index in smiles. A dictionary
+  // from storage can be much larger than the vector, so the entries that
+  // are not used are not converted
+  Vector smiles(LogicalType::VARCHAR, count);
+  auto smiles_data = FlatVector::GetData<string_t>(smiles);
+  auto &smiles_validity = FlatVector::Validity(smiles);
+  std::unordered_map<idx_t, sel_t> smiles_index;
+  SelectionVector result_sel(count);
+  sel_t smiles_count = 0;
+  for (idx_t i = 0; i < count; i++) {
+    auto entry = sel.get_index(i);
+    auto found = smiles_index.emplace(entry, smiles_count);
+    if (found.second) {
+      if (dictionary_validity.RowIsValid(entry)) {
+        smiles_data[smiles_count] =
+            AddMolSmiles(dictionary_data[entry], smiles, cache);
+      } else {
+        smiles_validity.SetInvalid(smiles_count);
+      }
+      smiles_count++;
+    }
+    result_sel.set_index(i, found.first->second);
+  }
+  result.Slice(smiles, result_sel, count);
 }
 
 void mol_to_smiles(DataChunk &args, ExpressionState &state, Vector &result) {
   D_ASSERT(args.data.size() == 1);
-  auto &bmol = args.data[0];
-  auto count = args.size();
+  auto &cache = GetMolCache(state.GetContext());
+  MolVectorToSmiles(args.data[0], result, args.size(), &cache);
+}
 
-  UnaryExecutor::Execute<string_t, string_t>(
-      bmol, result, count, [&](string_t b_umbra_mol) {
-        auto umbra_mol = umbra_mol_t(b_umbra_mol);
-        auto bmol = umbra_mol.GetBinaryMol();
-        auto mol = rdkit_binary_mol_to_mol(bmol);
-        auto smiles = rdkit_mol_to_smiles(*mol);
-        return StringVector::AddString(result, smiles);
-      });
+// The parser and the settings are set up once per thread rather than for
+// every row
+struct SmilesLocalState : public FunctionLocalState {
+  UmbraMolOptions options;
+  SmilesMolParser parser;
+  std::string error;
+};
+
+static unique_ptr<FunctionLocalState>
+InitSmilesLocalState(ExpressionState &state,
+                     const BoundFunctionExpression &expr,
+                     FunctionData *bind_data) {
+  auto result = make_uniq<SmilesLocalState>();
+  result->options = GetUmbraMolOptions(state.GetContext());
+  return std::move(result);
 }
 
+// The optional second argument says whether the molecule is sanitized,
+// overriding the rdkit_sanitize setting. Trusted input, e.g. canonical SMILES
+// from a curated database, can be loaded without
 void mol_from_smiles(DataChunk &args, ExpressionState &state, Vector &result) {
-  D_ASSERT(args.data.size() == 1);
+  D_ASSERT(args.data.size() == 1 || args.data.size() == 2);
   auto &smiles = args.data[0];
   auto count = args.size();
+  auto &lstate = ExecuteFunctionState::GetFunctionState(state)
+                     ->Cast<SmilesLocalState>();
+  auto options = lstate.options;
 
-  UnaryExecutor::ExecuteWithNulls<string_t, string_t>(
-      smiles, result, count,
-      [&](string_t smiles, ValidityMask &mask, idx_t idx) {
-        try {
-          auto mol = rdkit_mol_from_smiles(smiles.GetString());
+  auto convert = [&](string_t smiles, bool sanitize, ValidityMask &mask,
+                     idx_t idx) {
+    auto mol = lstate.parser.Parse(
+        std::string_view(smiles.GetData(), smiles.GetSize()), sanitize,
+        lstate.error);
+    if (!mol) {
+      mask.SetInvalid(idx);
+      return string_t();
+    }
+    options.sanitize = sanitize;
+    auto res = get_umbra_mol_string(*mol, options);
+
+    // IMPORTANT! StringVector::AddString needs to take a std::string
+    // Using string_t::GetString() seems to mangle the data
+    return StringVector::AddStringOrBlob(result, res);
+  };
 
-          auto res = get_umbra_mol_string(*mol);
+  if (args.data.size() == 1) {
+    UnaryExecutor::ExecuteWithNulls<string_t, string_t>(
+        smiles, result, count,
+        [&](string_t smiles, ValidityMask &mask, idx_t idx) {
+          return convert(smiles, lstate.options.sanitize, mask, idx);
+        });
+    return;
+  }
+  BinaryExecutor::ExecuteWithNulls<string_t, bool, string_t>(
+      smiles, args.data[1], result, count,
+      [&](string_t smiles, bool sanitize, ValidityMask &mask, idx_t idx) {
+        return convert(smiles, sanitize, mask, idx);
+      });
+}
 
-          // IMPORTANT! StringVector::AddString needs to take a std::string
-          // Using string_t::GetString() seems to mangle the data
-          return StringVector::AddStringOrBlob(result, res);
+// The qmol is the SMARTS itself, once it is known to be valid
+void mol_from_smarts(DataChunk &args, ExpressionState &state, Vector &result) {
+  D_ASSERT(args.data.size() == 1);
+  UnaryExecutor::ExecuteWithNulls<string_t, string_t>(
+      args.data[0], result, args.size(),
+      [&](string_t smarts, ValidityMask &mask, idx_t idx) {
+        try {
+          rdkit_mol_from_smarts(smarts.GetString());
+          return StringVector::AddString(result, smarts);
         } catch (...) {
           mask.SetInvalid(idx);
           return string_t();
@@ -105,15 +435,36 @@ void mol_to_rdkit_mol(DataChunk &args, ExpressionState &state, Vector &result) {
   UnaryExecutor::ExecuteWithNulls<string_t, string_t>(
       umbra_mol, result, count,
       [&](umbra_mol_t umbra_mol, ValidityMask &mask, idx_t idx) {
-        return StringVector::AddStringOrBlob(result, umbra_mol.GetBinaryMol());
+        // RDKit expects a sanitized pickle, so a molecule that is stored
+        // unsanitized or as a SMILES is read and pickled again
+        if (!umbra_mol.IsSanitized() || umbra_mol.IsSmilesPayload()) {
+          auto mol = rdkit_mol_from_umbra_mol(umbra_mol);
+          return StringVector::AddStringOrBlob(result,
+                                               rdkit_mol_to_binary_mol(*mol));
+        }
+        auto bmol = umbra_mol.GetBinaryMolView();
+        return StringVector::AddStringOrBlob(
+            result, string_t(bmol.data(), bmol.size()));
       });
 }
 
 void RegisterFormatFunctions(ExtensionLoader &loader) {
+  auto &config = DBConfig::GetConfig(loader.GetDatabaseInstance());
+  config.AddExtensionOption(
+      MOL_CACHE_SIZE_SETTING,
+      "Number of deserialized molecules each thread keeps, so that functions "
+      "called on the same Mol value only deserialize it once. 0 disables "
+      "the cache",
+      LogicalType::UBIGINT, Value::UBIGINT(0));
+
   // Register scalar functions
   ScalarFunctionSet mol_from_smiles_set("mol_from_smiles");
-  mol_from_smiles_set.AddFunction(
-      ScalarFunction({LogicalType::VARCHAR}, Mol(), mol_from_smiles));
+  ScalarFunction mol_from_smiles_fun({LogicalType::VARCHAR}, Mol(),
+                                     mol_from_smiles);
+  mol_from_smiles_fun.init_local_state = InitSmilesLocalState;
+  mol_from_smiles_set.AddFunction(mol_from_smiles_fun);
+  mol_from_smiles_fun.arguments.push_back(LogicalType::BOOLEAN);
+  mol_from_smiles_set.AddFunction(mol_from_smiles_fun);
   loader.RegisterFunction(mol_from_smiles_set);
 
   ScalarFunctionSet mol_to_smiles_set("mol_to_smiles");
@@ -121,6 +472,11 @@ void RegisterFormatFunctions(ExtensionLoader &loader) {
       ScalarFunction({Mol()}, LogicalType::VARCHAR, mol_to_smiles));
   loader.RegisterFunction(mol_to_smiles_set);
 
+  ScalarFunctionSet mol_from_smarts_set("mol_from_smarts");
+  mol_from_smarts_set.AddFunction(
+      ScalarFunction({LogicalType::VARCHAR}, QMol(), mol_from_smarts));
+  loader.RegisterFunction(mol_from_smarts_set);
+
   ScalarFunctionSet mol_to_rdkit_mol_set("mol_to_rdkit_mol");
   mol_to_rdkit_mol_set.AddFunction(
       ScalarFunction({Mol()}, LogicalType::BLOB, mol_to_rdkit_mol));
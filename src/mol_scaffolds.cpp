@@ -0,0 +1,101 @@
+#include "mol_scaffolds.hpp"
+#include "common.hpp"
+#include "duckdb/common/types/vector.hpp"
+#include "duckdb/common/vector_operations/unary_executor.hpp"
+#include "duckdb/execution/expression_executor.hpp"
+#include "duckdb/function/function_set.hpp"
+#include "duckdb/planner/expression/bound_function_expression.hpp"
+#include "mol_formats.hpp"
+#include "types.hpp"
+#include "umbra_mol.hpp"
+#include <GraphMol/ChemTransforms/ChemTransforms.h>
+#include <GraphMol/GraphMol.h>
+#include <GraphMol/MolOps.h>
+
+namespace duckdb_rdkit {
+
+// Returns the Bemis-Murcko scaffold of a molecule: its ring systems and the
+// linkers between them, with the side chains removed. A molecule without
+// rings has an empty scaffold.
+//
+// The scaffold is cut out of the deserialized molecule, which already carries
+// the aromaticity and valences of a sanitized molecule, so it is not sanitized
+// again. Like GetScaffoldForMol in the RDKit Python API, only the property
+// cache and the ring info are recomputed, since atoms and bonds were removed.
+static std::unique_ptr<RDKit::ROMol> murcko_scaffold(const RDKit::ROMol &mol) {
+  std::unique_ptr<RDKit::ROMol> scaffold(RDKit::MurckoDecompose(mol));
+  scaffold->clearComputedProps();
+  scaffold->updatePropertyCache(false);
+  RDKit::MolOps::findSSSR(*scaffold);
+  return scaffold;
+}
+
+// The settings for the new Mol values are read once per thread rather than
+// for every row
+struct ScaffoldLocalState : public FunctionLocalState {
+  UmbraMolOptions options;
+};
+
+static unique_ptr<FunctionLocalState>
+InitScaffoldLocalState(ExpressionState &state,
+                       const BoundFunctionExpression &expr,
+                       FunctionData *bind_data) {
+  auto result = make_uniq<ScaffoldLocalState>();
+  result->options = GetUmbraMolOptions(state.GetContext());
+  return std::move(result);
+}
+
+static void mol_murcko_scaffold(DataChunk &args, ExpressionState &state,
+                                Vector &result) {
+  D_ASSERT(args.data.size() == 1);
+  auto &binary_umbra_mol = args.data[0];
+  auto count = args.size();
+  auto &lstate = ExecuteFunctionState::GetFunctionState(state)
+                     ->Cast<ScaffoldLocalState>();
+  auto options = lstate.options;
+  auto &cache = GetMolCache(state.GetContext());
+
+  UnaryExecutor::Execute<string_t, string_t>(
+      binary_umbra_mol, result, count, [&](string_t b_umbra_mol) {
+        auto umbra_mol = umbra_mol_t(b_umbra_mol);
+        auto scaffold = murcko_scaffold(cache.Get(umbra_mol));
+        // The scaffold of an unsanitized molecule is stored unsanitized too
+        options.sanitize = umbra_mol.IsSanitized();
+        return StringVector::AddStringOrBlob(
+            result, get_umbra_mol_string(*scaffold, options));
+      });
+}
+
+// mol_scaffold_hash(mol) is mol_hash(mol_murcko_scaffold(mol)), without
+// building the Mol value of the scaffold. Grouping and partitioning by the
+// hash compares integers rather than SMILES
+static void mol_scaffold_hash(DataChunk &args, ExpressionState &state,
+                              Vector &result) {
+  D_ASSERT(args.data.size() == 1);
+  auto &binary_umbra_mol = args.data[0];
+  auto count = args.size();
+  auto &cache = GetMolCache(state.GetContext());
+
+  UnaryExecutor::Execute<string_t, uint64_t>(
+      binary_umbra_mol, result, count, [&](string_t b_umbra_mol) {
+        auto umbra_mol = umbra_mol_t(b_umbra_mol);
+        return make_mol_hash(*murcko_scaffold(cache.Get(umbra_mol)));
+      });
+}
+
+void RegisterScaffoldFunctions(ExtensionLoader &loader) {
+  ScalarFunctionSet set_mol_murcko_scaffold("mol_murcko_scaffold");
+  ScalarFunction mol_murcko_scaffold_fun({duckdb_rdkit::Mol()},
+                                         duckdb_rdkit::Mol(),
+                                         mol_murcko_scaffold);
+  mol_murcko_scaffold_fun.init_local_state = InitScaffoldLocalState;
+  set_mol_murcko_scaffold.AddFunction(mol_murcko_scaffold_fun);
+  loader.RegisterFunction(set_mol_murcko_scaffold);
+
+  ScalarFunctionSet set_mol_scaffold_hash("mol_scaffold_hash");
+  set_mol_scaffold_hash.AddFunction(ScalarFunction(
+      {duckdb_rdkit::Mol()}, LogicalType::UBIGINT, mol_scaffold_hash));
+  loader.RegisterFunction(set_mol_scaffold_hash);
+}
+
+} // namespace duckdb_rdkit
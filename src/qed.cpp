@@ -13,9 +13,18 @@
 
 namespace duckdb_rdkit {
 
-std::vector<RDKit::RWMol> QED::smarts2mols(std::vector<std::string> smarts) {
+const QED &QED::Get() {
+  // Initialization of a function-local static is thread-safe, so the
+  // patterns are only parsed once even if several threads get here at once
+  static const QED qed;
+  return qed;
+}
+
+std::vector<RDKit::RWMol>
+QED::smarts2mols(const std::vector<std::string> &smarts) {
   std::vector<RDKit::RWMol> mols;
-  for (auto s : smarts) {
+  mols.reserve(smarts.size());
+  for (const auto &s : smarts) {
     std::unique_ptr<RDKit::RWMol> mol;
     mol.reset(RDKit::SmartsToMol(s));
     mols.push_back(*mol);
@@ -23,20 +32,15 @@ std::vector<RDKit::RWMol> QED::smarts2mols(std::vector<std::string> smarts) {
   return mols;
 }
 
-double QED::calcADS(float x, std::string adsParameterKey) {
-  auto p = QED::adsParameters[adsParameterKey];
+double QED::calcADS(float x, const std::string &adsParameterKey) const {
+  auto &p = adsParameters.at(adsParameterKey);
   auto exp1 = 1 + std::exp(-1 * (x - p.C + p.D / 2) / p.E);
   auto exp2 = 1 + std::exp(-1 * (x - p.C - p.D / 2) / p.F);
   auto dx = p.A + p.B / exp1 * (1 - 1 / exp2);
   return dx / p.DMAX;
 }
 
-QED::QEDproperties
-QED::calcProperties(const RDKit::ROMol &mol,
-                    std::vector<RDKit::RWMol> acceptorMols,
-                    std::unique_ptr<RDKit::RWMol> aliphaticRingMol,
-                    std::vector<RDKit::RWMol> alertMols) {
-  auto molWithoutHs = RDKit::MolOps::removeHs(mol);
+QED::QEDproperties QED::calcProperties(const RDKit::ROMol &mol) const {
   auto amw = RDKit::Descriptors::calcAMW(mol);
   double crippenLogP = 0;
   double _mr = 0;
@@ -45,7 +49,7 @@ QED::calcProperties(const RDKit::ROMol &mol,
   // find all hydrogen bond acceptors
   RDKit::MatchVectType matchVect;
   auto hba = 0;
-  for (auto m : acceptorMols) {
+  for (const auto &m : acceptorMols) {
     bool match = RDKit::SubstructMatch(mol, m, matchVect);
     hba += matchVect.size();
   }
@@ -53,11 +57,12 @@ QED::calcProperties(const RDKit::ROMol &mol,
   auto hbd = RDKit::Descriptors::calcNumHBD(mol);
   auto psa = RDKit::Descriptors::calcTPSA(mol);
   auto rotb = RDKit::Descriptors::calcNumRotatableBonds(mol, true);
-  auto withoutAliphaticRings = RDKit::deleteSubstructs(mol, *aliphaticRingMol);
+  std::unique_ptr<RDKit::ROMol> withoutAliphaticRings(
+      RDKit::deleteSubstructs(mol, *aliphaticRingsMol));
   auto arom = RDKit::MolOps::findSSSR(*withoutAliphaticRings);
 
   auto alerts = 0;
-  for (auto &m : alertMols) {
+  for (const auto &m : alertMols) {
     bool match = RDKit::SubstructMatch(mol, m, matchVect);
     if (match) {
       alerts += 1;
@@ -67,16 +72,15 @@ QED::calcProperties(const RDKit::ROMol &mol,
   return QEDproperties(amw, crippenLogP, hba, hbd, psa, rotb, arom, alerts);
 }
 
-float QED::CalcQED(const RDKit::ROMol &mol) {
-  auto properties = calcProperties(mol, acceptorMols,
-                                   std::move(aliphaticRingsMol), alertMols);
+float QED::CalcQED(const RDKit::ROMol &mol) const {
+  auto properties = calcProperties(mol);
   float sumOfWeightedADSValues = 0.0;
   float sumOfWeights = 0.0;
 
   for (const auto &[k, v] : properties.data) {
-    sumOfWeightedADSValues +=
-        (WEIGHT_MEAN.data[k] * std::log(calcADS(properties.data[k], k)));
-    sumOfWeights += WEIGHT_MEAN.data[k];
+    auto weight = WEIGHT_MEAN.data.at(k);
+    sumOfWeightedADSValues += (weight * std::log(calcADS(v, k)));
+    sumOfWeights += weight;
   }
 
   return std::exp(sumOfWeightedADSValues / sumOfWeights);
@@ -1,6 +1,9 @@
 #include "rdkit_log.hpp"
+#include "duckdb/common/mutex.hpp"
 #include "duckdb/function/scalar_function.hpp"
+#include "duckdb/function/table_function.hpp"
 #include <RDGeneral/RDLog.h>
+#include <map>
 
 namespace duckdb_rdkit {
 
@@ -46,6 +49,100 @@ static void rdkit_log_status(DataChunk &args, ExpressionState &state,
   }
 }
 
+// The totals of the screen stats of each function since the last
+// rdkit_stats_reset(), over all connections
+static mutex stats_lock;
+static std::map<std::string, ScreenStats> function_stats;
+
+void FlushScreenStats(const std::string &function_name, ScreenStats &stats) {
+  if (stats.rows == 0) {
+    return;
+  }
+  {
+    lock_guard<mutex> guard(stats_lock);
+    auto &total = function_stats[function_name];
+    total.rows += stats.rows;
+    total.prefix_rejected += stats.prefix_rejected;
+    total.dalke_fp_rejected += stats.dalke_fp_rejected;
+    total.screen_rejected += stats.screen_rejected;
+    total.hash_rejected += stats.hash_rejected;
+    total.full_match_rows += stats.full_match_rows;
+    total.matches += stats.matches;
+    total.rdkit_nanos += stats.rdkit_nanos;
+  }
+  stats = ScreenStats();
+}
+
+struct StatsGlobalState : public GlobalTableFunctionState {
+  // A copy of the totals when the scan started
+  std::vector<std::pair<std::string, ScreenStats>> stats;
+  idx_t offset = 0;
+};
+
+static unique_ptr<FunctionData> RDKitStatsBind(ClientContext &context,
+                                               TableFunctionBindInput &input,
+                                               vector<LogicalType> &types,
+                                               vector<string> &names) {
+  names.emplace_back("function");
+  types.emplace_back(LogicalType::VARCHAR);
+  for (auto name : {"rows", "prefix_rejected", "dalke_fp_rejected",
+                    "screen_rejected", "hash_rejected", "full_match_rows",
+                    "matches"}) {
+    names.emplace_back(name);
+    types.emplace_back(LogicalType::UBIGINT);
+  }
+  names.emplace_back("rdkit_seconds");
+  types.emplace_back(LogicalType::DOUBLE);
+  return nullptr;
+}
+
+static unique_ptr<GlobalTableFunctionState>
+RDKitStatsInit(ClientContext &context, TableFunctionInitInput &input) {
+  auto result = make_uniq<StatsGlobalState>();
+  lock_guard<mutex> guard(stats_lock);
+  result->stats.assign(function_stats.begin(), function_stats.end());
+  return std::move(result);
+}
+
+// rdkit_stats() - The screen stats of is_exact_match and the substructure
+// functions, one row per function
+static void RDKitStatsFunction(ClientContext &context,
+                               TableFunctionInput &data_p, DataChunk &output) {
+  auto &state = data_p.global_state->Cast<StatsGlobalState>();
+  idx_t count = 0;
+  for (; state.offset < state.stats.size() && count < STANDARD_VECTOR_SIZE;
+       state.offset++, count++) {
+    auto &[name, stats] = state.stats[state.offset];
+    idx_t col = 0;
+    output.SetValue(col++, count, Value(name));
+    for (auto value : {stats.rows, stats.prefix_rejected,
+                       stats.dalke_fp_rejected, stats.screen_rejected,
+                       stats.hash_rejected, stats.full_match_rows,
+                       stats.matches}) {
+      output.SetValue(col++, count, Value::UBIGINT(value));
+    }
+    output.SetValue(col++, count, Value::DOUBLE(stats.rdkit_nanos / 1e9));
+  }
+  output.SetCardinality(count);
+}
+
+// rdkit_stats_reset() - Reset the screen stats of all functions
+static void rdkit_stats_reset(DataChunk &args, ExpressionState &state,
+                              Vector &result) {
+  auto count = args.size();
+
+  {
+    lock_guard<mutex> guard(stats_lock);
+    function_stats.clear();
+  }
+
+  // Return true to indicate success
+  auto result_data = FlatVector::GetData<bool>(result);
+  for (idx_t i = 0; i < count; i++) {
+    result_data[i] = true;
+  }
+}
+
 void RegisterLogFunctions(ExtensionLoader &loader) {
   // rdkit_log_disable() - returns BOOLEAN
   ScalarFunctionSet disable_set("rdkit_log_disable");
@@ -64,6 +161,20 @@ void RegisterLogFunctions(ExtensionLoader &loader) {
   status_set.AddFunction(
       ScalarFunction({}, LogicalType::VARCHAR, rdkit_log_status));
   loader.RegisterFunction(status_set);
+
+  // rdkit_stats() - returns a row of screen stats per function
+  TableFunction stats_function("rdkit_stats", {}, RDKitStatsFunction,
+                               RDKitStatsBind, RDKitStatsInit);
+  loader.RegisterFunction(stats_function);
+
+  // rdkit_stats_reset() - returns BOOLEAN
+  ScalarFunctionSet reset_set("rdkit_stats_reset");
+  auto reset_function =
+      ScalarFunction({}, LogicalType::BOOLEAN, rdkit_stats_reset);
+  // Must not be folded into a constant, or be evaluated only once
+  reset_function.stability = FunctionStability::VOLATILE;
+  reset_set.AddFunction(reset_function);
+  loader.RegisterFunction(reset_set);
 }
 
 } // namespace duckdb_rdkit
@@ -0,0 +1,74 @@
+#include "rdkit_memory.hpp"
+#include "duckdb/main/client_context.hpp"
+#include "duckdb/main/database.hpp"
+#include "duckdb/storage/buffer_manager.hpp"
+#include <GraphMol/Atom.h>
+#include <GraphMol/Bond.h>
+#include <GraphMol/RWMol.h>
+
+namespace duckdb_rdkit {
+
+// Besides the Atom and Bond objects, every atom has a vertex and every bond
+// an edge in the boost graph, both with their property dicts, and every bond
+// is in the adjacency lists of two atoms and in the ring info. These are
+// rough per-atom and per-bond sizes of all that
+static constexpr idx_t ATOM_OVERHEAD = 96;
+static constexpr idx_t BOND_OVERHEAD = 128;
+
+idx_t EstimateMolMemory(const RDKit::ROMol &mol) {
+  return sizeof(RDKit::RWMol) +
+         mol.getNumAtoms() * (sizeof(RDKit::Atom) + ATOM_OVERHEAD) +
+         mol.getNumBonds() * (sizeof(RDKit::Bond) + BOND_OVERHEAD);
+}
+
+RDKitMemoryReservation::RDKitMemoryReservation(ClientContext &context)
+    : db(context.db) {}
+
+RDKitMemoryReservation::~RDKitMemoryReservation() {
+  // Destructors must not throw, and shrinking never does
+  Resize(0);
+}
+
+void RDKitMemoryReservation::SetDatabase(ClientContext &context) {
+  auto current = db.lock();
+  if (current.get() == context.db.get()) {
+    return;
+  }
+  auto reserved = size;
+  Resize(0);
+  db = context.db;
+  Resize(reserved);
+}
+
+void RDKitMemoryReservation::Resize(idx_t new_size) {
+  if (new_size == size) {
+    return;
+  }
+  auto database = db.lock();
+  if (!database) {
+    // Without a database there is nothing to reserve with, and what was
+    // reserved went away with it
+    size = 0;
+    return;
+  }
+  auto &buffer_manager = BufferManager::GetBufferManager(*database);
+  if (new_size > size) {
+    buffer_manager.ReserveMemory(new_size - size);
+  } else {
+    buffer_manager.FreeReservedMemory(size - new_size);
+  }
+  size = new_size;
+}
+
+idx_t MemoryBoundThreads(ClientContext &context, idx_t thread_memory,
+                         idx_t max_threads) {
+  auto &buffer_manager = BufferManager::GetBufferManager(context);
+  auto max_memory = buffer_manager.GetMaxMemory();
+  auto used_memory = buffer_manager.GetUsedMemory();
+  auto available = max_memory > used_memory ? max_memory - used_memory : 0;
+  return MaxValue<idx_t>(
+      1, MinValue<idx_t>(max_threads, available / MaxValue<idx_t>(
+                                                      thread_memory, 1)));
+}
+
+} // namespace duckdb_rdkit
@@ -3,6 +3,7 @@
 #include "duckdb/common/multi_file/multi_file_list.hpp"
 #include "duckdb/common/multi_file/multi_file_reader.hpp"
 #include "duckdb/common/open_file_info.hpp"
+#include "duckdb/common/string_util.hpp"
 #include "duckdb/common/types.hpp"
 #include "duckdb/common/types/vector.hpp"
 #include "duckdb/function/function.hpp"
@@ -22,50 +23,16 @@ static void ReadSDFFunction(ClientContext &context, TableFunctionInput &data_p,
 
   auto &gstate = data_p.global_state->Cast<SDFGlobalTableFunctionState>().state;
   auto &lstate = data_p.local_state->Cast<SDFLocalTableFunctionState>().state;
-  auto bind_data = data_p.bind_data->Cast<SDFScanData>();
 
-  lstate.ExtractNextChunk(gstate, lstate, bind_data);
+  //! The records are written straight into the vectors of the output chunk
+  lstate.ExtractNextChunk(gstate, output);
 
-  D_ASSERT(lstate.scan_count == lstate.rows.size());
   //! set to the number of rows scanned
   //! If the cardinality is zero, it will signal to duckdb to not run the read
-  //! function anymore because the scan is done. This is not equal to the number
-  //! of rows returned, if perhaps during predicate pushdown, no rows match.
-  //! If we are not done scanning the file, we would need to keep scanning
-  //! to see if there are other records that match the predicate
+  //! function anymore because the scan is done. Records filtered out by the
+  //! pushed down filters are not counted, but the scan keeps going until
+  //! a chunk has at least one record or all ranges are done
   output.SetCardinality(lstate.scan_count);
-
-  //! If the molecule column is not requested, the mol_col_idx flag is set to -1
-  //! This will cause an access error when trying to slice into the vector.
-  //! Therefore, set the index to 0 to avoid the error. The mol_col will not be
-  //! used anyways in this case.
-  if (bind_data.mol_col_idx == -1) {
-    bind_data.mol_col_idx = 0;
-  }
-  //! The mol_col is a reference to the DataChunk vector
-  //! This vector is then converted to a FlatVector with the string_t type
-  //! so that we can add blobs to it, which may have invalid UTF8.
-  auto &mol_col = output.data[bind_data.mol_col_idx];
-  auto col_data = FlatVector::GetData<string_t>(mol_col);
-
-  //! For each record/row scanned, set the value of each
-  //! column in the output DataChunk
-  for (idx_t i = 0; i < lstate.rows.size(); i++) {
-    for (idx_t j = 0; j < bind_data.names.size(); j++) {
-      auto val = lstate.rows[i][j];
-      //! handle the molecule column differently because it's a BLOB with
-      //! potentially invalid UTF8
-      if (bind_data.mol_col_idx > -1 && j == bind_data.mol_col_idx) {
-        col_data[i] = StringVector::AddStringOrBlob(mol_col, string_t(val));
-      } else {
-        if (val == "") {
-          output.SetValue(j, i, Value(nullptr));
-        } else {
-          output.SetValue(j, i, Value(val));
-        }
-      }
-    }
-  }
 }
 
 unique_ptr<FunctionData> ReadSDFBind(ClientContext &context,
@@ -74,6 +41,17 @@ unique_ptr<FunctionData> ReadSDFBind(ClientContext &context,
                                      vector<string> &names) {
   auto bind_data = make_uniq<SDFScanData>();
   bind_data->Bind(context, input);
+  auto buffer_size_entry = input.named_parameters.find("buffer_size");
+  if (buffer_size_entry != input.named_parameters.end()) {
+    if (buffer_size_entry->second.IsNull()) {
+      throw BinderException("read_sdf parameter \"buffer_size\" cannot be NULL.");
+    }
+    bind_data->buffer_size = UBigIntValue::Get(buffer_size_entry->second);
+    if (bind_data->buffer_size == 0) {
+      throw BinderException(
+          "read_sdf \"buffer_size\" parameter must be greater than 0.");
+    }
+  }
   if (input.table_function.name == "read_sdf_auto") {
     SDFScan::AutoDetect(context, *bind_data, return_types, names);
   } else {
@@ -153,10 +131,31 @@ unique_ptr<FunctionData> ReadSDFBind(ClientContext &context,
   for (auto &file_info : all_files) {
     bind_data->files.push_back(file_info.path);
   }
-  if (bind_data->files.size() > 1) {
-    throw NotImplementedException(
-        "Reading more than one sdf file is currently not supported.");
+
+  //! The filename column is added after the columns read from the records
+  auto filename_entry = input.named_parameters.find("filename");
+  if (filename_entry != input.named_parameters.end()) {
+    if (filename_entry->second.IsNull()) {
+      throw BinderException("read_sdf parameter \"filename\" cannot be NULL.");
+    }
+    if (BooleanValue::Get(filename_entry->second)) {
+      for (auto &name : names) {
+        if (StringUtil::CIEquals(name, "filename")) {
+          throw BinderException(
+              "read_sdf option \"filename\" adds a column named "
+              "\"filename\", but a column with this name is already read "
+              "from the file.");
+        }
+      }
+      names.push_back("filename");
+      bind_data->types.push_back(
+          LogicalTypeIdToString(LogicalTypeId::VARCHAR));
+      bind_data->filename_col_idx = names.size() - 1;
+      return_types.emplace_back(LogicalType::VARCHAR);
+      bind_data->names = names;
+    }
   }
+  bind_data->return_types = return_types;
 
   return std::move(bind_data);
 }
@@ -195,8 +194,12 @@ TableFunctionSet SDFFunctions::GetReadSDFTableFunction() {
                                SDFLocalTableFunctionState::Init);
   table_function.name = "read_sdf";
   table_function.named_parameters["columns"] = LogicalType::ANY;
+  table_function.named_parameters["buffer_size"] = LogicalType::UBIGINT;
+  table_function.named_parameters["filename"] = LogicalType::BOOLEAN;
   table_function.table_scan_progress = SDFScan::ScanProgress;
-  table_function.projection_pushdown = false;
+  table_function.get_partition_data = SDFScan::GetPartitionData;
+  table_function.projection_pushdown = true;
+  table_function.filter_pushdown = true;
   return MultiFileReader::CreateFunctionSet(table_function);
 }
 
@@ -206,8 +209,12 @@ TableFunctionSet SDFFunctions::GetReadSDFAutoTableFunction() {
                                SDFLocalTableFunctionState::Init);
   table_function.name = "read_sdf_auto";
   table_function.named_parameters["columns"] = LogicalType::ANY;
+  table_function.named_parameters["buffer_size"] = LogicalType::UBIGINT;
+  table_function.named_parameters["filename"] = LogicalType::BOOLEAN;
   table_function.table_scan_progress = SDFScan::ScanProgress;
-  table_function.projection_pushdown = false;
+  table_function.get_partition_data = SDFScan::GetPartitionData;
+  table_function.projection_pushdown = true;
+  table_function.filter_pushdown = true;
   return MultiFileReader::CreateFunctionSet(table_function);
 }
 
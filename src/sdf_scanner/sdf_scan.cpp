@@ -1,17 +1,28 @@
 #include "sdf_scanner/sdf_scan.hpp"
 #include "duckdb/common/allocator.hpp"
+#include "duckdb/common/file_system.hpp"
 #include "duckdb/common/helper.hpp"
 #include "duckdb/common/multi_file/multi_file_reader.hpp"
 #include "duckdb/common/string_util.hpp"
 #include "duckdb/common/types.hpp"
 #include "duckdb/common/unique_ptr.hpp"
+#include "duckdb/common/vector_operations/vector_operations.hpp"
 #include "duckdb/common/vector_size.hpp"
 #include "duckdb/function/table_function.hpp"
 #include "duckdb/main/client_context.hpp"
+#include "duckdb/planner/expression/bound_reference_expression.hpp"
+#include "duckdb/planner/filter/conjunction_filter.hpp"
+#include "duckdb/planner/filter/constant_filter.hpp"
+#include "duckdb/planner/filter/expression_filter.hpp"
+#include "duckdb/planner/filter/in_filter.hpp"
+#include "duckdb/planner/filter/null_filter.hpp"
+#include "duckdb/planner/table_filter.hpp"
 #include "mol_formats.hpp"
 #include "types.hpp"
 #include "umbra_mol.hpp"
+#include <cstring>
 #include <memory>
+#include <set>
 
 namespace duckdb {
 SDFScanData::SDFScanData() {}
@@ -40,142 +51,554 @@ SDFLocalTableFunctionState::Init(ExecutionContext &context,
 unique_ptr<GlobalTableFunctionState>
 SDFGlobalTableFunctionState::Init(ClientContext &context,
                                   TableFunctionInitInput &input) {
-  auto &bind_data = input.bind_data->Cast<SDFScanData>();
   auto result = make_uniq<SDFGlobalTableFunctionState>(context, input);
-  auto &gstate = result->state;
-
   return std::move(result);
 }
 
+void SDFRangeReader::Reset(FileHandle &handle_p, idx_t file_size_p,
+                           const SDFScanRange &range) {
+  handle = &handle_p;
+  file_size = file_size_p;
+  range_end = range.end;
+  finished = false;
+  if (!buffer) {
+    buffer = make_unsafe_uniq_array<char>(READ_BUFFER_SIZE);
+  }
+  buffer_offset = 0;
+  buffer_length = 0;
+  position = range.start;
+
+  if (range.start == 0) {
+    //! The first record of the file starts at byte 0
+    at_record_start = true;
+    return;
+  }
+  //! Skip the rest of the line a range starts in, unless the range starts
+  //! right at the beginning of a line. That line belongs to the previous range
+  at_record_start = false;
+  position = range.start - 1;
+  string line;
+  ReadLine(line);
+}
+
+bool SDFRangeReader::IsRecordTerminator(const string &line) {
+  idx_t end = line.size();
+  while (end > 0 && StringUtil::CharacterIsSpace(line[end - 1])) {
+    end--;
+  }
+  return end == 4 && line.compare(0, 4, "$$$$") == 0;
+}
+
+bool SDFRangeReader::ReadLine(string &line) {
+  if (position >= file_size) {
+    return false;
+  }
+  while (position < file_size) {
+    if (position < buffer_offset ||
+        position >= buffer_offset + buffer_length) {
+      buffer_offset = position;
+      buffer_length = MinValue<idx_t>(READ_BUFFER_SIZE, file_size - position);
+      handle->Read(buffer.get(), buffer_length, buffer_offset);
+    }
+    auto start = buffer.get() + (position - buffer_offset);
+    auto available = buffer_offset + buffer_length - position;
+    auto newline = (const char *)memchr(start, '\n', available);
+    if (newline) {
+      idx_t len = newline - start + 1;
+      line.append(start, len);
+      position += len;
+      return true;
+    }
+    line.append(start, available);
+    position += available;
+  }
+  //! The last line of the file does not end with a newline
+  return true;
+}
+
+bool SDFRangeReader::NextRecord(string &record, idx_t &record_start) {
+  string line;
+  record.clear();
+  while (!finished) {
+    if (!at_record_start) {
+      //! Look for the "$$$$" line that precedes the first record of the range.
+      //! Only a "$$$$" line that starts inside the range counts
+      if (position >= range_end) {
+        finished = true;
+        return false;
+      }
+      line.clear();
+      if (!ReadLine(line)) {
+        finished = true;
+        return false;
+      }
+      at_record_start = IsRecordTerminator(line);
+      continue;
+    }
+
+    //! Read the lines of the record up to and including its "$$$$" line,
+    //! even if that goes past the end of the range
+    record_start = position;
+    bool has_content = false;
+    while (true) {
+      line.clear();
+      auto line_start = position;
+      if (!ReadLine(line)) {
+        //! The last record of a file does not need to be terminated
+        finished = true;
+        if (has_content) {
+          record += "$$$$\n";
+        }
+        break;
+      }
+      if (IsRecordTerminator(line)) {
+        record += line;
+        //! The record after this one belongs to this range only if its
+        //! "$$$$" line starts inside the range
+        at_record_start = line_start < range_end;
+        finished = !at_record_start;
+        break;
+      }
+      if (!has_content) {
+        for (auto c : line) {
+          if (!StringUtil::CharacterIsSpace(c)) {
+            has_content = true;
+            break;
+          }
+        }
+      }
+      record += line;
+    }
+    if (has_content) {
+      return true;
+    }
+    //! Skip blank space, e.g. trailing newlines at the end of the file
+    record.clear();
+  }
+  return false;
+}
+
+void SDFRecordParser::NextLine(const string &record, idx_t &pos,
+                               idx_t &line_end) {
+  auto newline = record.find('\n', pos);
+  if (newline == string::npos) {
+    line_end = record.size();
+    pos = record.size();
+  } else {
+    line_end = newline;
+    pos = newline + 1;
+  }
+  if (line_end > 0 && record[line_end - 1] == '\r') {
+    line_end--;
+  }
+}
+
+bool SDFRecordParser::IsBlank(const string &record, idx_t start, idx_t end) {
+  for (idx_t i = start; i < end; i++) {
+    if (!StringUtil::CharacterIsSpace(record[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+idx_t SDFRecordParser::MolBlockEnd(const string &record) {
+  idx_t pos = 0;
+  idx_t line_end;
+  //! The first three lines are the header block of the molblock, which can
+  //! hold any text
+  for (idx_t i = 0; i < 3 && pos < record.size(); i++) {
+    NextLine(record, pos, line_end);
+  }
+  while (pos < record.size()) {
+    auto line_start = pos;
+    NextLine(record, pos, line_end);
+    if (record.compare(line_start, 6, "M  END") == 0) {
+      return pos;
+    }
+  }
+  return record.size();
+}
+
+//! Checks a value read from a record against a filter pushed down by duckdb.
+//! The values are checked one record at a time, because the point of pushing
+//! the filters down is to skip parsing the molblocks of records that are
+//! filtered out
+static bool FilterMatches(ClientContext &context, const TableFilter &filter,
+                          const Value &value) {
+  switch (filter.filter_type) {
+  case TableFilterType::CONSTANT_COMPARISON:
+    return !value.IsNull() && filter.Cast<ConstantFilter>().Compare(value);
+  case TableFilterType::IS_NULL:
+    return value.IsNull();
+  case TableFilterType::IS_NOT_NULL:
+    return !value.IsNull();
+  case TableFilterType::IN_FILTER: {
+    if (value.IsNull()) {
+      return false;
+    }
+    for (auto &in_value : filter.Cast<InFilter>().values) {
+      if (value == in_value) {
+        return true;
+      }
+    }
+    return false;
+  }
+  case TableFilterType::CONJUNCTION_AND: {
+    for (auto &child : filter.Cast<ConjunctionAndFilter>().child_filters) {
+      if (!FilterMatches(context, *child, value)) {
+        return false;
+      }
+    }
+    return true;
+  }
+  case TableFilterType::CONJUNCTION_OR: {
+    for (auto &child : filter.Cast<ConjunctionOrFilter>().child_filters) {
+      if (FilterMatches(context, *child, value)) {
+        return true;
+      }
+    }
+    return false;
+  }
+  case TableFilterType::EXPRESSION_FILTER:
+    return filter.Cast<ExpressionFilter>().EvaluateWithConstant(context, value);
+  case TableFilterType::OPTIONAL_FILTER:
+  case TableFilterType::DYNAMIC_FILTER:
+    //! These only allow skipping data early, the filter itself is still
+    //! applied after the scan
+    return true;
+  default: {
+    //! Any other filter is turned into an expression on the column, and
+    //! evaluated with the value in place of the column
+    BoundReferenceExpression column(value.type(), 0);
+    ExpressionFilter expression_filter(filter.ToExpression(column));
+    return expression_filter.EvaluateWithConstant(context, value);
+  }
+  }
+}
+
+//! The value of a column of a record, as it will be written to the output
+static Value ColumnValue(const string &val, const LogicalType &type) {
+  if (val.empty()) {
+    return Value(type);
+  }
+  if (type.id() == LogicalTypeId::BLOB) {
+    //! the Mol column, which is a BLOB with potentially invalid UTF8
+    auto result = Value::BLOB(const_data_ptr_cast(val.data()), val.size());
+    result.Reinterpret(type);
+    return result;
+  }
+  return Value(val).DefaultCastAs(type);
+}
+
 SDFScanGlobalState::SDFScanGlobalState(ClientContext &context_p,
-                                       const SDFScanData &bind_data_p)
-    : bind_data(bind_data_p) {
-  //! open the sd file
-  //! RDKit throws an exception for empty/invalid files
-  try {
-    mol_supplier =
-        make_uniq<RDKit::v2::FileParsers::SDMolSupplier>(bind_data.files[0]);
-    length = mol_supplier->length();
-  } catch (const std::exception &e) {
-    //! Empty or invalid SDF file - set length to 0
-    mol_supplier = nullptr;
-    length = 0;
-  }
-  offset = 0;
+                                       const SDFScanData &bind_data_p,
+                                       const vector<column_t> &column_ids,
+                                       optional_ptr<TableFilterSet> filters)
+    : bind_data(bind_data_p), total_size(0), range_count(0), bytes_scanned(0),
+      next_range_idx(0), next_file_idx(0), next_range_start(0) {
+  //! Work out what each projected column holds, so that the scan only
+  //! extracts what the query needs
+  for (idx_t i = 0; i < column_ids.size(); i++) {
+    auto col_id = column_ids[i];
+    column_filters.emplace_back();
+    if (col_id >= bind_data.names.size()) {
+      //! e.g. the row id, when no column is needed for a count(*)
+      column_kinds.push_back(SDFColumnKind::VIRTUAL);
+      column_types.push_back(LogicalType::SQLNULL);
+      names.emplace_back();
+      continue;
+    }
+    names.push_back(bind_data.names[col_id]);
+    column_types.push_back(bind_data.return_types[col_id]);
+    if (bind_data.mol_col_idx > -1 && col_id == (idx_t)bind_data.mol_col_idx) {
+      column_kinds.push_back(SDFColumnKind::MOL);
+      mol_column = i;
+    } else if (bind_data.filename_col_idx > -1 &&
+               col_id == (idx_t)bind_data.filename_col_idx) {
+      column_kinds.push_back(SDFColumnKind::FILENAME);
+    } else {
+      column_kinds.push_back(SDFColumnKind::PROPERTY);
+      property_columns[bind_data.names[col_id]] = i;
+    }
+  }
+  //! The filters are keyed by the position of the column in column_ids
+  if (filters) {
+    for (auto &entry : filters->filters) {
+      //! Filters on virtual columns are checked like those on properties,
+      //! against the NULL that the scan writes for them
+      if (entry.first >= column_kinds.size()) {
+        throw InternalException("read_sdf got a filter on column %d, which "
+                                "is not one of the scanned columns",
+                                entry.first);
+      }
+      column_filters[entry.first] = entry.second.get();
+      if (column_kinds[entry.first] == SDFColumnKind::MOL) {
+        has_mol_filter = true;
+      }
+    }
+  }
+
+  auto &fs = FileSystem::GetFileSystem(context_p);
+  for (auto &file : bind_data.files) {
+    auto handle = fs.OpenFile(file, FileFlags::FILE_FLAGS_READ);
+    auto file_size = handle->GetFileSize();
+    file_sizes.push_back(file_size);
+    total_size += file_size;
+    range_count +=
+        (file_size + bind_data.buffer_size - 1) / bind_data.buffer_size;
+  }
+  max_threads = duckdb_rdkit::MemoryBoundThreads(
+      context_p, THREAD_MEMORY, MaxValue<idx_t>(range_count, 1));
+}
+
+bool SDFScanGlobalState::ClaimRange(SDFScanRange &range) {
+  lock_guard<mutex> guard(lock);
+  //! Move on to the next file once the current one has been handed out.
+  //! Empty files have no ranges
+  while (next_file_idx < file_sizes.size() &&
+         next_range_start >= file_sizes[next_file_idx]) {
+    next_file_idx++;
+    next_range_start = 0;
+  }
+  if (next_file_idx >= file_sizes.size()) {
+    return false;
+  }
+  range.range_idx = next_range_idx++;
+  range.file_idx = next_file_idx;
+  range.start = next_range_start;
+  range.end = MinValue<idx_t>(range.start + bind_data.buffer_size,
+                              file_sizes[next_file_idx]);
+  next_range_start = range.end;
+  return true;
 }
 
+idx_t SDFScanGlobalState::MaxThreads() const { return max_threads; }
+
 SDFScanLocalState::SDFScanLocalState(ClientContext &context_p,
                                      SDFScanGlobalState &gstate_p)
-    : scan_count(0), bind_data(gstate_p.bind_data) {}
+    : scan_count(0), range{0, 0, 0, 0}, bind_data(gstate_p.bind_data),
+      context(context_p), fs(FileSystem::GetFileSystem(context_p)),
+      mol_options(duckdb_rdkit::GetUmbraMolOptions(context_p)),
+      memory(context_p) {
+  memory.Resize(SDFScanGlobalState::THREAD_MEMORY);
+}
+
+void SDFScanLocalState::ReserveMolMemory(const RDKit::ROMol &mol) {
+  auto size = duckdb_rdkit::EstimateMolMemory(mol);
+  if (size > mol_memory) {
+    mol_memory = size;
+    memory.Resize(SDFScanGlobalState::THREAD_MEMORY + mol_memory);
+  }
+}
 
 SDFGlobalTableFunctionState::SDFGlobalTableFunctionState(
     ClientContext &context, TableFunctionInitInput &input)
-    : state(context, input.bind_data->Cast<SDFScanData>()) {}
+    : state(context, input.bind_data->Cast<SDFScanData>(), input.column_ids,
+            input.filters) {}
 
 void SDFScanLocalState::ExtractNextChunk(SDFScanGlobalState &gstate,
-                                         SDFScanLocalState &lstate,
-                                         SDFScanData &bind_data) {
+                                         DataChunk &output) {
 
   //! This holds the number of records scanned in this current
   //! function call.
   //! Reset to zero each time this function is called.
   //! If nothing gets scanned, the scan_count will be just zero
   //! and duckdb will be signalled that the scanning is complete
-  lstate.scan_count = 0;
-  lstate.rows.clear();
+  scan_count = 0;
 
-  //! If mol_supplier is null (empty/invalid file), return immediately
-  if (!gstate.mol_supplier) {
-    return;
+  auto column_count = gstate.column_kinds.size();
+  if (values.size() != column_count) {
+    values.resize(column_count);
+    cast_vectors.resize(column_count);
+  }
+  //! The string vectors of columns that have to be cast are made per chunk,
+  //! so that they do not keep the strings of previous chunks alive
+  for (idx_t i = 0; i < column_count; i++) {
+    auto &type = gstate.column_types[i];
+    if (gstate.column_kinds[i] == SDFColumnKind::PROPERTY &&
+        type.id() != LogicalTypeId::VARCHAR) {
+      cast_vectors[i] = make_uniq<Vector>(LogicalType::VARCHAR);
+    }
   }
 
-  while (lstate.scan_count < STANDARD_VECTOR_SIZE &&
-         !gstate.mol_supplier->atEnd()) {
-    auto remaining = gstate.length - lstate.scan_count;
-    if (remaining == 0) {
-      break;
+  while (scan_count < STANDARD_VECTOR_SIZE) {
+    if (!range_active) {
+      //! A chunk only holds records of one range, so that its batch index
+      //! is the index of that range
+      if (scan_count > 0) {
+        break;
+      }
+      if (!gstate.ClaimRange(range)) {
+        break;
+      }
+      if (range.file_idx != file_handle_idx) {
+        file_handle = fs.OpenFile(bind_data.files[range.file_idx],
+                                  FileFlags::FILE_FLAGS_READ);
+        file_handle_idx = range.file_idx;
+      }
+      reader.Reset(*file_handle, gstate.file_sizes[range.file_idx], range);
+      range_active = true;
+      for (idx_t i = 0; i < column_count; i++) {
+        if (gstate.column_kinds[i] == SDFColumnKind::FILENAME) {
+          values[i] = bind_data.files[range.file_idx];
+        }
+      }
     }
 
-    bool printed_warning = false;
-    vector<string> cur_row;
-    auto cur_mol = gstate.mol_supplier->next();
-    //! Go through each column specified and store the property in a vector
-    //! This represents one row in the "table".
-    for (idx_t i = 0; i < bind_data.names.size(); i++) {
-      //! NOTE: using the RDKit MolSupplier, if the record cannot be parsed,
-      //! it is because the molecule cannot be parsed. The other columns are
-      //! probably not null, but right now nothing of that record is
-      //! stored because that cannot be accessed with the way the MolSupplier
-      //! is implemented.
-      //!
-      //! TODO: write a parser to parse the non-molecule parts of the SDF.
-      //! This may enable filter pushdown and also allow the other fields
-      //! to be returned even if the molecule cannot be parsed
-      if (cur_mol) {
-        //! The column at the current iteration of i is the Mol type
-        //! In this case, we should convert the molecule object
-        //! to the "umbra" mol in duckdb_rdkit
-        if (StringUtil::CIEquals(bind_data.types[i], duckdb_rdkit::Mol().ToString())) {
-          auto res = duckdb_rdkit::get_umbra_mol_string(*cur_mol);
-          cur_row.emplace_back(res);
-        } else {
-          //! Otherwise, it is a normal property column
-          std::string prop;
-          cur_mol->getPropIfPresent(bind_data.names[i], prop);
-          cur_row.emplace_back(prop);
+    idx_t record_start;
+    if (!reader.NextRecord(record, record_start)) {
+      range_active = false;
+      gstate.bytes_scanned += range.end - range.start;
+      continue;
+    }
+
+    auto molblock_end = SDFRecordParser::MolBlockEnd(record);
+    if (!gstate.property_columns.empty()) {
+      for (idx_t i = 0; i < column_count; i++) {
+        if (gstate.column_kinds[i] == SDFColumnKind::PROPERTY) {
+          values[i].clear();
         }
-      } else {
-        //! only print the warning once per record, not once per column
-        //! of the record
-        if (!printed_warning) {
-          std::cout << "Molecule could not be constructed at record #: "
-                    << gstate.offset << std::endl;
-          printed_warning = true;
+      }
+      SDFRecordParser::ParseDataItems(
+          record, molblock_end,
+          [&](const char *name, idx_t name_length) -> string * {
+            item_name.assign(name, name_length);
+            auto entry = gstate.property_columns.find(item_name);
+            return entry == gstate.property_columns.end()
+                       ? nullptr
+                       : &values[entry->second];
+          });
+    }
+
+    //! Skip the record before its molecule is built if any of the filters
+    //! on its properties does not match
+    bool matches = true;
+    for (idx_t i = 0; i < column_count && matches; i++) {
+      if (gstate.column_filters[i] &&
+          gstate.column_kinds[i] != SDFColumnKind::MOL) {
+        matches &= FilterMatches(
+            context, *gstate.column_filters[i],
+            ColumnValue(values[i], gstate.column_types[i]));
+      }
+    }
+    if (!matches) {
+      continue;
+    }
+
+    if (gstate.mol_column != DConstants::INVALID_INDEX) {
+      //! Only build the molecule when the Mol column is projected.
+      //! RDKit throws an exception if the molblock cannot be parsed, in which
+      //! case the Mol is NULL and the other columns are still returned
+      auto &mol_value = values[gstate.mol_column];
+      mol_value.clear();
+      std::unique_ptr<RDKit::RWMol> cur_mol;
+      try {
+        RDKit::v2::FileParsers::MolFileParserParams params;
+        params.sanitize = mol_options.sanitize;
+        params.removeHs = mol_options.sanitize;
+        cur_mol = RDKit::v2::FileParsers::MolFromMolBlock(
+            record.substr(0, molblock_end), params);
+        if (cur_mol && !mol_options.sanitize) {
+          //! The valences are needed to pickle the molecule
+          cur_mol->updatePropertyCache(true);
         }
-        cur_row.emplace_back("");
+      } catch (const std::exception &e) {
+        cur_mol = nullptr;
+      }
+      if (cur_mol) {
+        ReserveMolMemory(*cur_mol);
+        //! convert the molecule object to the "umbra" mol in duckdb_rdkit
+        mol_value = duckdb_rdkit::get_umbra_mol_string(*cur_mol, mol_options);
+      }
+      if (gstate.has_mol_filter &&
+          !FilterMatches(context, *gstate.column_filters[gstate.mol_column],
+                         ColumnValue(mol_value,
+                                     gstate.column_types[gstate.mol_column]))) {
+        continue;
+      }
+    }
+
+    //! Write the record into the output vectors
+    for (idx_t i = 0; i < column_count; i++) {
+      auto kind = gstate.column_kinds[i];
+      if (kind == SDFColumnKind::VIRTUAL || kind == SDFColumnKind::FILENAME) {
+        //! These are the same for every record of the chunk
+        continue;
+      }
+      auto &col = cast_vectors[i] ? *cast_vectors[i] : output.data[i];
+      auto &val = values[i];
+      if (val.empty()) {
+        FlatVector::SetNull(col, scan_count, true);
+        continue;
+      }
+      //! the molecule column is a BLOB with potentially invalid UTF8
+      FlatVector::GetData<string_t>(col)[scan_count] =
+          kind == SDFColumnKind::MOL
+              ? StringVector::AddStringOrBlob(col, val.data(), val.size())
+              : StringVector::AddString(col, val.data(), val.size());
+    }
+    scan_count++;
+  }
+
+  if (scan_count == 0) {
+    return;
+  }
+  for (idx_t i = 0; i < column_count; i++) {
+    auto &col = output.data[i];
+    switch (gstate.column_kinds[i]) {
+    case SDFColumnKind::VIRTUAL:
+      //! Nothing is read for virtual columns such as the row id
+      col.SetVectorType(VectorType::CONSTANT_VECTOR);
+      ConstantVector::SetNull(col, true);
+      break;
+    case SDFColumnKind::FILENAME:
+      //! A chunk only holds records of one range, and so of one file
+      col.SetVectorType(VectorType::CONSTANT_VECTOR);
+      ConstantVector::GetData<string_t>(col)[0] =
+          StringVector::AddString(col, values[i]);
+      break;
+    default:
+      if (cast_vectors[i]) {
+        VectorOperations::DefaultCast(*cast_vectors[i], col, scan_count);
       }
+      break;
     }
-    lstate.rows.emplace_back(cur_row);
-    lstate.scan_count++;
-    gstate.offset++;
   }
 }
 
 void SDFScan::AutoDetect(ClientContext &context, SDFScanData &bind_data,
                          vector<LogicalType> &return_types,
                          vector<string> &names) {
-  //! open the sd file to scan the first record
-  //! RDKit throws an exception for empty/invalid files, so we catch it
-  try {
-    auto mol_supplier =
-        make_uniq<RDKit::v2::FileParsers::SDMolSupplier>(bind_data.files[0]);
-    while (!mol_supplier->atEnd()) {
-
-      auto cur_mol = mol_supplier->next();
-      std::set<string> seen;
-      if (cur_mol) {
-        for (auto p : cur_mol->getPropList()) {
-          //! These are props seem to be added by RDKit...these are there
-          //! even if the SDF doesn't contain these properties
-          if (p != "__computedProps" && p != "_Name" && p != "_MolFileInfo" &&
-              p != "_MolFileComments" && p != "_MolFileChiralFlag" &&
-              p != "numArom" && p != "_StereochemDone") {
-            names.push_back(p);
+  auto &fs = FileSystem::GetFileSystem(context);
+  SDFRangeReader reader;
+  string record;
+  std::set<string> seen;
+  for (auto &file : bind_data.files) {
+    auto handle = fs.OpenFile(file, FileFlags::FILE_FLAGS_READ);
+    auto file_size = handle->GetFileSize();
+    reader.Reset(*handle, file_size, SDFScanRange{0, 0, 0, file_size});
+    idx_t record_start;
+    if (!reader.NextRecord(record, record_start)) {
+      //! Empty file - it adds no properties
+      continue;
+    }
+    SDFRecordParser::ParseDataItems(
+        record, SDFRecordParser::MolBlockEnd(record),
+        [&](const char *name, idx_t name_length) -> string * {
+          string item_name(name, name_length);
+          if (seen.insert(item_name).second) {
+            names.push_back(item_name);
             bind_data.types.emplace_back(
                 LogicalTypeIdToString(LogicalTypeId::VARCHAR));
             return_types.emplace_back(TransformStringToLogicalType(
                 StringValue::Get("VARCHAR"), context));
           }
-        }
-        break;
-      }
-    }
-    mol_supplier->close();
-  } catch (const std::exception &e) {
-    //! Empty or invalid SDF file - we'll just return the mol column
+          return nullptr;
+        });
   }
 
-  //! The molecule block is not in the getPropList
+  //! The molecule block is not one of the data items
   names.push_back("mol");
   bind_data.types.push_back("Mol");
   bind_data.mol_col_idx = names.size() - 1;
@@ -190,7 +613,18 @@ SDFLocalTableFunctionState::SDFLocalTableFunctionState(
 double SDFScan::ScanProgress(ClientContext &, const FunctionData *,
                              const GlobalTableFunctionState *global_state) {
   auto &gstate = global_state->Cast<SDFGlobalTableFunctionState>().state;
-  return 100.0 * (double)gstate.offset / (double)gstate.length;
+  if (gstate.total_size == 0) {
+    return 100.0;
+  }
+  return 100.0 * (double)gstate.bytes_scanned.load() /
+         (double)gstate.total_size;
+}
+
+OperatorPartitionData
+SDFScan::GetPartitionData(ClientContext &,
+                          TableFunctionGetPartitionInput &input) {
+  auto &lstate = input.local_state->Cast<SDFLocalTableFunctionState>().state;
+  return OperatorPartitionData(lstate.range.range_idx);
 }
 
 } // namespace duckdb
@@ -0,0 +1,303 @@
+#include "similarity_search.hpp"
+#include "bfp.hpp"
+#include "common.hpp"
+#include "duckdb/common/types/vector.hpp"
+#include "duckdb/execution/expression_executor.hpp"
+#include "duckdb/function/aggregate_function.hpp"
+#include "duckdb/function/function_set.hpp"
+#include "types.hpp"
+#include <algorithm>
+#include <vector>
+
+namespace duckdb_rdkit {
+
+// tanimoto_knn(id, fp, query, k [, threshold]) is an aggregate that returns
+// the k rows whose fingerprints are the most similar to the query, as a list
+// of {id, similarity} structs ordered from the most to the least similar.
+//
+// Unlike ORDER BY tanimoto_sml(fp, query) DESC LIMIT k, most rows are not
+// even scored. The Tanimoto similarity of two fingerprints with a and b bits
+// set is at most min(a, b) / max(a, b) (the Swamidass-Baldi bound). The
+// popcount of a bfp is in its inlined prefix, so this bound is computed
+// without touching the bits of the fingerprint, and a row is skipped when
+// its bound is below the threshold, or below the k-th best similarity found
+// so far by the thread. Each thread keeps a bounded heap of its best k rows,
+// and the heaps are merged when the states are combined.
+
+struct KnnBindData : public FunctionData {
+  KnnBindData(std::string query_p, idx_t k_p, double threshold_p)
+      : query(std::move(query_p)), k(k_p), threshold(threshold_p) {
+    string_t query_str(query.data(), UnsafeNumericCast<uint32_t>(query.size()));
+    auto fp = bfp_t(query_str);
+    fp.Verify();
+    query_popcount = fp.GetPopcount();
+    query_num_bits = fp.GetNumBits();
+  }
+
+  //! The query fingerprint
+  std::string query;
+  uint32_t query_popcount;
+  uint32_t query_num_bits;
+  //! The number of neighbours to return
+  idx_t k;
+  //! Rows less similar than this are never returned
+  double threshold;
+
+  const_data_ptr_t QueryWords() const {
+    return const_data_ptr_cast(query.data() + bfp_t::HEADER_BYTES);
+  }
+
+  unique_ptr<FunctionData> Copy() const override {
+    return make_uniq<KnnBindData>(query, k, threshold);
+  }
+
+  bool Equals(const FunctionData &other_p) const override {
+    auto &other = other_p.Cast<KnnBindData>();
+    return query == other.query && k == other.k &&
+           threshold == other.threshold;
+  }
+};
+
+struct KnnEntry {
+  double similarity;
+  Value id;
+};
+
+// Orders the entries from the most to the least similar. Ties are broken on
+// the id so that the result does not depend on the order rows are seen in
+static bool KnnBetter(const KnnEntry &a, const KnnEntry &b) {
+  if (a.similarity != b.similarity) {
+    return a.similarity > b.similarity;
+  }
+  if (a.id.IsNull() || b.id.IsNull()) {
+    return !a.id.IsNull() && b.id.IsNull();
+  }
+  return a.id < b.id;
+}
+
+struct KnnState {
+  //! A heap of the best entries found so far, with the worst at the front
+  std::vector<KnnEntry> *heap;
+
+  //! Rows whose similarity cannot beat this are skipped
+  double MinimumSimilarity(const KnnBindData &bind_data) const {
+    if (heap && heap->size() >= bind_data.k) {
+      return MaxValue(heap->front().similarity, bind_data.threshold);
+    }
+    return bind_data.threshold;
+  }
+
+  void Insert(KnnEntry entry, const KnnBindData &bind_data) {
+    if (!heap) {
+      heap = new std::vector<KnnEntry>();
+    }
+    if (heap->size() < bind_data.k) {
+      heap->push_back(std::move(entry));
+      std::push_heap(heap->begin(), heap->end(), KnnBetter);
+    } else if (KnnBetter(entry, heap->front())) {
+      std::pop_heap(heap->begin(), heap->end(), KnnBetter);
+      heap->back() = std::move(entry);
+      std::push_heap(heap->begin(), heap->end(), KnnBetter);
+    }
+  }
+};
+
+struct KnnOperation {
+  template <class STATE>
+  static void Initialize(STATE &state) {
+    state.heap = nullptr;
+  }
+
+  template <class STATE>
+  static void Destroy(STATE &state, AggregateInputData &) {
+    delete state.heap;
+    state.heap = nullptr;
+  }
+
+  static bool IgnoreNull() { return true; }
+};
+
+// Scores the rows of a chunk against the query and adds them to their states.
+// `get_state(i)` returns the state of row i
+template <class GET_STATE>
+static void KnnUpdate(Vector inputs[], const KnnBindData &bind_data,
+                      idx_t count, GET_STATE &&get_state) {
+  auto &ids = inputs[0];
+  UnifiedVectorFormat fp_data;
+  inputs[1].ToUnifiedFormat(count, fp_data);
+  auto fps = UnifiedVectorFormat::GetData<string_t>(fp_data);
+  auto query_words = bind_data.QueryWords();
+  double query_popcount = bind_data.query_popcount;
+
+  for (idx_t i = 0; i < count; i++) {
+    auto idx = fp_data.sel->get_index(i);
+    if (!fp_data.validity.RowIsValid(idx)) {
+      continue;
+    }
+    auto &state = get_state(i);
+    auto fp = bfp_t(fps[idx]);
+    // The bound only needs the popcount in the prefix of the string_t
+    double popcount = fp.GetPopcount();
+    auto bound = popcount == 0 && query_popcount == 0
+                     ? 0.0
+                     : MinValue(popcount, query_popcount) /
+                           MaxValue(popcount, query_popcount);
+    auto minimum = state.MinimumSimilarity(bind_data);
+    if (bound < minimum) {
+      continue;
+    }
+    fp.Verify();
+    if (fp.GetNumBits() != bind_data.query_num_bits) {
+      throw InvalidInputException(
+          "cannot compare bfp fingerprints of different sizes (%d and %d "
+          "bits)",
+          fp.GetNumBits(), bind_data.query_num_bits);
+    }
+    auto common = bfp_intersect_popcount(fp.GetWords(), query_words,
+                                         fp.GetWordCount());
+    auto similarity =
+        tanimoto_sml(fp.GetPopcount(), bind_data.query_popcount, common);
+    if (similarity < minimum) {
+      continue;
+    }
+    state.Insert(KnnEntry{similarity, ids.GetValue(i)}, bind_data);
+  }
+}
+
+static void KnnScatterUpdate(Vector inputs[], AggregateInputData &aggr_input_data,
+                             idx_t input_count, Vector &states, idx_t count) {
+  auto &bind_data = aggr_input_data.bind_data->Cast<KnnBindData>();
+  UnifiedVectorFormat sdata;
+  states.ToUnifiedFormat(count, sdata);
+  auto state_ptrs = UnifiedVectorFormat::GetData<KnnState *>(sdata);
+  KnnUpdate(inputs, bind_data, count, [&](idx_t i) -> KnnState & {
+    return *state_ptrs[sdata.sel->get_index(i)];
+  });
+}
+
+static void KnnSimpleUpdate(Vector inputs[], AggregateInputData &aggr_input_data,
+                            idx_t input_count, data_ptr_t state_p,
+                            idx_t count) {
+  auto &bind_data = aggr_input_data.bind_data->Cast<KnnBindData>();
+  auto &state = *reinterpret_cast<KnnState *>(state_p);
+  KnnUpdate(inputs, bind_data, count,
+            [&](idx_t) -> KnnState & { return state; });
+}
+
+static void KnnCombine(Vector &source, Vector &target,
+                       AggregateInputData &aggr_input_data, idx_t count) {
+  auto &bind_data = aggr_input_data.bind_data->Cast<KnnBindData>();
+  auto sources = FlatVector::GetData<KnnState *>(source);
+  auto targets = FlatVector::GetData<KnnState *>(target);
+  for (idx_t i = 0; i < count; i++) {
+    auto &source_state = *sources[i];
+    if (!source_state.heap) {
+      continue;
+    }
+    for (auto &entry : *source_state.heap) {
+      targets[i]->Insert(entry, bind_data);
+    }
+  }
+}
+
+static void KnnFinalize(Vector &states, AggregateInputData &aggr_input_data,
+                        Vector &result, idx_t count, idx_t offset) {
+  UnifiedVectorFormat sdata;
+  states.ToUnifiedFormat(count, sdata);
+  auto state_ptrs = UnifiedVectorFormat::GetData<KnnState *>(sdata);
+
+  if (states.GetVectorType() == VectorType::CONSTANT_VECTOR) {
+    result.SetVectorType(VectorType::CONSTANT_VECTOR);
+  } else {
+    result.SetVectorType(VectorType::FLAT_VECTOR);
+  }
+  auto list_entries = FlatVector::GetData<list_entry_t>(result);
+
+  for (idx_t i = 0; i < count; i++) {
+    auto &state = *state_ptrs[sdata.sel->get_index(i)];
+    auto rid = states.GetVectorType() == VectorType::CONSTANT_VECTOR
+                   ? 0
+                   : i + offset;
+    auto list_offset = ListVector::GetListSize(result);
+    idx_t length = 0;
+    if (state.heap) {
+      // Sort a copy, the state is still a heap if it is finalized again
+      auto entries = *state.heap;
+      std::sort(entries.begin(), entries.end(), KnnBetter);
+      length = entries.size();
+      ListVector::Reserve(result, list_offset + length);
+      auto &children = StructVector::GetEntries(ListVector::GetEntry(result));
+      auto similarities = FlatVector::GetData<double>(*children[1]);
+      for (idx_t j = 0; j < length; j++) {
+        auto &entry = entries[j];
+        children[0]->SetValue(list_offset + j, entry.id);
+        similarities[list_offset + j] = entry.similarity;
+      }
+      ListVector::SetListSize(result, list_offset + length);
+    }
+    list_entries[rid].offset = list_offset;
+    list_entries[rid].length = length;
+  }
+}
+
+static unique_ptr<FunctionData>
+KnnBind(ClientContext &context, AggregateFunction &function,
+        vector<unique_ptr<Expression>> &arguments) {
+  for (idx_t i = 2; i < arguments.size(); i++) {
+    if (!arguments[i]->IsFoldable()) {
+      throw BinderException(
+          "tanimoto_knn: the query, k and threshold must be constants");
+    }
+  }
+  auto query = ExpressionExecutor::EvaluateScalar(context, *arguments[2]);
+  auto k = ExpressionExecutor::EvaluateScalar(context, *arguments[3]);
+  if (query.IsNull() || k.IsNull()) {
+    throw BinderException("tanimoto_knn: the query and k cannot be NULL");
+  }
+  auto k_value = IntegerValue::Get(k.DefaultCastAs(LogicalType::INTEGER));
+  if (k_value <= 0) {
+    throw BinderException("tanimoto_knn: k must be greater than 0");
+  }
+  double threshold = 0;
+  if (arguments.size() == 5) {
+    auto threshold_value =
+        ExpressionExecutor::EvaluateScalar(context, *arguments[4]);
+    if (threshold_value.IsNull()) {
+      throw BinderException("tanimoto_knn: the threshold cannot be NULL");
+    }
+    threshold = DoubleValue::Get(
+        threshold_value.DefaultCastAs(LogicalType::DOUBLE));
+  }
+
+  // The id can be of any type, and is returned as is
+  auto &id_type = arguments[0]->return_type;
+  function.arguments[0] = id_type;
+  function.return_type = LogicalType::LIST(LogicalType::STRUCT(
+      {{"id", id_type}, {"similarity", LogicalType::DOUBLE}}));
+  return make_uniq<KnnBindData>(StringValue::Get(query), k_value, threshold);
+}
+
+static AggregateFunction GetKnnFunction(const vector<LogicalType> &arguments) {
+  AggregateFunction fun(
+      "tanimoto_knn", arguments, LogicalType::LIST(LogicalType::ANY),
+      AggregateFunction::StateSize<KnnState>,
+      AggregateFunction::StateInitialize<KnnState, KnnOperation>,
+      KnnScatterUpdate, KnnCombine, KnnFinalize,
+      FunctionNullHandling::SPECIAL_HANDLING, KnnSimpleUpdate, KnnBind,
+      AggregateFunction::StateDestroy<KnnState, KnnOperation>);
+  fun.order_dependent = AggregateOrderDependent::NOT_ORDER_DEPENDENT;
+  return fun;
+}
+
+void RegisterSimilaritySearchFunctions(ExtensionLoader &loader) {
+  AggregateFunctionSet set_tanimoto_knn("tanimoto_knn");
+  set_tanimoto_knn.AddFunction(GetKnnFunction(
+      {LogicalType::ANY, duckdb_rdkit::Bfp(), duckdb_rdkit::Bfp(),
+       LogicalType::INTEGER}));
+  set_tanimoto_knn.AddFunction(GetKnnFunction(
+      {LogicalType::ANY, duckdb_rdkit::Bfp(), duckdb_rdkit::Bfp(),
+       LogicalType::INTEGER, LogicalType::DOUBLE}));
+  loader.RegisterFunction(set_tanimoto_knn);
+}
+
+} // namespace duckdb_rdkit
@@ -0,0 +1,111 @@
+#include "smiles_scanner/smiles_functions.hpp"
+#include "duckdb/common/multi_file/multi_file_reader.hpp"
+#include "duckdb/common/string_util.hpp"
+#include "duckdb/common/types.hpp"
+#include "duckdb/function/replacement_scan.hpp"
+#include "duckdb/function/table_function.hpp"
+#include "duckdb/main/client_context.hpp"
+#include "duckdb/parser/expression/constant_expression.hpp"
+#include "duckdb/parser/expression/function_expression.hpp"
+#include "duckdb/parser/tableref/table_function_ref.hpp"
+#include "smiles_scanner/smiles_scan.hpp"
+#include "types.hpp"
+
+namespace duckdb {
+
+static void ReadSMILESFunction(ClientContext &context,
+                               TableFunctionInput &data_p, DataChunk &output) {
+  auto &gstate =
+      data_p.global_state->Cast<SMILESGlobalTableFunctionState>().state;
+  auto &lstate =
+      data_p.local_state->Cast<SMILESLocalTableFunctionState>().state;
+
+  //! The molecules are written straight into the vectors of the output chunk
+  lstate.ExtractNextChunk(gstate, output);
+
+  //! A cardinality of zero signals duckdb that the scan is done
+  output.SetCardinality(lstate.scan_count);
+}
+
+static unique_ptr<FunctionData>
+ReadSMILESBind(ClientContext &context, TableFunctionBindInput &input,
+               vector<LogicalType> &return_types, vector<string> &names) {
+  auto bind_data = make_uniq<SMILESScanData>();
+  bind_data->Bind(context, input);
+
+  bool add_filename = false;
+  for (auto &kv : input.named_parameters) {
+    auto loption = StringUtil::Lower(kv.first);
+    if (kv.second.IsNull()) {
+      throw BinderException("read_smiles parameter \"%s\" cannot be NULL.",
+                            loption);
+    }
+    if (loption == "buffer_size") {
+      bind_data->buffer_size = UBigIntValue::Get(kv.second);
+      if (bind_data->buffer_size == 0) {
+        throw BinderException(
+            "read_smiles \"buffer_size\" parameter must be greater than 0.");
+      }
+    } else if (loption == "header") {
+      bind_data->header = BooleanValue::Get(kv.second);
+    } else if (loption == "filename") {
+      add_filename = BooleanValue::Get(kv.second);
+    } else if (loption == "rejects_table") {
+      bind_data->rejects_table = StringValue::Get(kv.second);
+      if (bind_data->rejects_table.empty()) {
+        throw BinderException(
+            "read_smiles \"rejects_table\" parameter cannot be empty.");
+      }
+    }
+  }
+
+  names.push_back("mol");
+  return_types.push_back(duckdb_rdkit::Mol());
+  names.push_back("name");
+  return_types.push_back(LogicalType::VARCHAR);
+  if (add_filename) {
+    names.push_back("filename");
+    return_types.push_back(LogicalType::VARCHAR);
+  }
+  bind_data->names = names;
+  bind_data->return_types = return_types;
+
+  return std::move(bind_data);
+}
+
+unique_ptr<TableRef>
+SMILESFunctions::ReadSMILESReplacement(ClientContext &context,
+                                       ReplacementScanInput &input,
+                                       optional_ptr<ReplacementScanData> data) {
+  auto table_name = ReplacementScan::GetFullPath(input);
+
+  if (!ReplacementScan::CanReplace(table_name, {"smi"})) {
+    return nullptr;
+  }
+
+  auto table_function = make_uniq<TableFunctionRef>();
+  vector<unique_ptr<ParsedExpression>> children;
+  children.push_back(make_uniq<ConstantExpression>(Value(table_name)));
+  table_function->function =
+      make_uniq<FunctionExpression>("read_smiles", std::move(children));
+
+  return std::move(table_function);
+}
+
+TableFunctionSet SMILESFunctions::GetReadSMILESTableFunction() {
+  TableFunction table_function({LogicalType::VARCHAR}, ReadSMILESFunction,
+                               ReadSMILESBind,
+                               SMILESGlobalTableFunctionState::Init,
+                               SMILESLocalTableFunctionState::Init);
+  table_function.name = "read_smiles";
+  table_function.named_parameters["buffer_size"] = LogicalType::UBIGINT;
+  table_function.named_parameters["header"] = LogicalType::BOOLEAN;
+  table_function.named_parameters["filename"] = LogicalType::BOOLEAN;
+  table_function.named_parameters["rejects_table"] = LogicalType::VARCHAR;
+  table_function.table_scan_progress = SMILESScan::ScanProgress;
+  table_function.get_partition_data = SMILESScan::GetPartitionData;
+  table_function.projection_pushdown = true;
+  return MultiFileReader::CreateFunctionSet(table_function);
+}
+
+} // namespace duckdb
@@ -0,0 +1,400 @@
+#include "smiles_scanner/smiles_scan.hpp"
+#include "duckdb/catalog/catalog.hpp"
+#include "duckdb/catalog/catalog_entry/table_catalog_entry.hpp"
+#include "duckdb/common/file_system.hpp"
+#include "duckdb/common/helper.hpp"
+#include "duckdb/common/multi_file/multi_file_reader.hpp"
+#include "duckdb/common/string_util.hpp"
+#include "duckdb/common/types.hpp"
+#include "duckdb/common/vector_size.hpp"
+#include "duckdb/function/table_function.hpp"
+#include "duckdb/main/appender.hpp"
+#include "duckdb/main/client_context.hpp"
+#include "duckdb/parser/parsed_data/create_table_info.hpp"
+#include "types.hpp"
+#include "umbra_mol.hpp"
+#include <cstring>
+
+namespace duckdb {
+
+void SMILESScanData::Bind(ClientContext &context,
+                          TableFunctionBindInput &input) {
+  auto multi_file_reader = MultiFileReader::Create(input.table_function);
+  auto file_list = multi_file_reader->CreateFileList(context, input.inputs[0]);
+
+  files.clear();
+  for (auto &file_info : file_list->GetAllFiles()) {
+    files.push_back(file_info.path);
+  }
+}
+
+unique_ptr<LocalTableFunctionState>
+SMILESLocalTableFunctionState::Init(ExecutionContext &context,
+                                    TableFunctionInitInput &,
+                                    GlobalTableFunctionState *global_state) {
+  auto &gstate = global_state->Cast<SMILESGlobalTableFunctionState>();
+  return make_uniq<SMILESLocalTableFunctionState>(context.client,
+                                                  gstate.state);
+}
+
+unique_ptr<GlobalTableFunctionState>
+SMILESGlobalTableFunctionState::Init(ClientContext &context,
+                                     TableFunctionInitInput &input) {
+  return make_uniq<SMILESGlobalTableFunctionState>(context, input);
+}
+
+void SMILESRangeReader::Reset(FileHandle &handle_p, idx_t file_size_p,
+                              const SMILESScanRange &range, bool skip_header) {
+  handle = &handle_p;
+  file_size = file_size_p;
+  range_end = range.end;
+  if (!buffer) {
+    buffer = make_unsafe_uniq_array<char>(READ_BUFFER_SIZE);
+  }
+  buffer_offset = 0;
+  buffer_length = 0;
+
+  string skipped;
+  if (range.start == 0) {
+    position = 0;
+    if (skip_header) {
+      ReadLine(skipped);
+    }
+    return;
+  }
+  //! Skip the rest of the line a range starts in, unless the range starts
+  //! right at the beginning of a line. That line belongs to the previous range
+  position = range.start - 1;
+  ReadLine(skipped);
+}
+
+bool SMILESRangeReader::ReadLine(string &line) {
+  if (position >= file_size) {
+    return false;
+  }
+  while (position < file_size) {
+    if (position < buffer_offset ||
+        position >= buffer_offset + buffer_length) {
+      buffer_offset = position;
+      buffer_length = MinValue<idx_t>(READ_BUFFER_SIZE, file_size - position);
+      handle->Read(buffer.get(), buffer_length, buffer_offset);
+    }
+    auto start = buffer.get() + (position - buffer_offset);
+    auto available = buffer_offset + buffer_length - position;
+    auto newline = (const char *)memchr(start, '\n', available);
+    if (newline) {
+      idx_t len = newline - start + 1;
+      line.append(start, len);
+      position += len;
+      return true;
+    }
+    line.append(start, available);
+    position += available;
+  }
+  //! The last line of the file does not end with a newline
+  return true;
+}
+
+bool SMILESRangeReader::NextLine(string &line, idx_t &line_start) {
+  //! Only a line that starts inside the range belongs to it
+  if (position >= range_end) {
+    return false;
+  }
+  line.clear();
+  line_start = position;
+  if (!ReadLine(line)) {
+    return false;
+  }
+  while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) {
+    line.pop_back();
+  }
+  return true;
+}
+
+static bool IsFieldSeparator(char c) { return c == ' ' || c == '\t'; }
+
+bool SMILESLineParser::Split(const string &line, std::string_view &smiles,
+                             std::string_view &name) {
+  idx_t pos = 0;
+  while (pos < line.size() && IsFieldSeparator(line[pos])) {
+    pos++;
+  }
+  if (pos == line.size()) {
+    return false;
+  }
+  auto smiles_start = pos;
+  while (pos < line.size() && !IsFieldSeparator(line[pos])) {
+    pos++;
+  }
+  auto smiles_end = pos;
+  while (pos < line.size() && IsFieldSeparator(line[pos])) {
+    pos++;
+  }
+  //! A CXSMILES extension is separated from the SMILES by a space
+  if (pos < line.size() && line[pos] == '|') {
+    auto extension_end = line.find('|', pos + 1);
+    if (extension_end != string::npos) {
+      smiles_end = extension_end + 1;
+      pos = smiles_end;
+      while (pos < line.size() && IsFieldSeparator(line[pos])) {
+        pos++;
+      }
+    }
+  }
+  auto name_start = pos;
+  while (pos < line.size() && !IsFieldSeparator(line[pos])) {
+    pos++;
+  }
+  smiles = std::string_view(line.data() + smiles_start,
+                            smiles_end - smiles_start);
+  name = std::string_view(line.data() + name_start, pos - name_start);
+  return true;
+}
+
+SMILESScanGlobalState::SMILESScanGlobalState(
+    ClientContext &context, const SMILESScanData &bind_data_p,
+    const vector<column_t> &column_ids)
+    : bind_data(bind_data_p), total_size(0), range_count(0), bytes_scanned(0),
+      next_range_idx(0), next_file_idx(0), next_range_start(0) {
+  for (auto col_id : column_ids) {
+    switch (col_id) {
+    case SMILESScanData::MOL_COLUMN:
+      column_kinds.push_back(SMILESColumnKind::MOL);
+      parse_mols = true;
+      break;
+    case SMILESScanData::NAME_COLUMN:
+      column_kinds.push_back(SMILESColumnKind::NAME);
+      break;
+    case SMILESScanData::FILENAME_COLUMN:
+      column_kinds.push_back(SMILESColumnKind::FILENAME);
+      break;
+    default:
+      //! e.g. the row id, when no column is needed for a count(*)
+      column_kinds.push_back(SMILESColumnKind::VIRTUAL);
+      break;
+    }
+  }
+
+  if (!bind_data.rejects_table.empty()) {
+    //! The rejected lines are not returned, so every line has to be parsed
+    //! even if the Mol is not projected
+    parse_mols = true;
+    //! The table of a previous scan is replaced, as DuckDB does for the
+    //! rejects table of read_csv
+    auto &catalog = Catalog::GetCatalog(context, TEMP_CATALOG);
+    auto info = make_uniq<CreateTableInfo>(TEMP_CATALOG, DEFAULT_SCHEMA,
+                                           bind_data.rejects_table);
+    info->temporary = true;
+    info->on_conflict = OnCreateConflict::REPLACE_ON_CONFLICT;
+    info->columns.AddColumn(ColumnDefinition("file", LogicalType::VARCHAR));
+    info->columns.AddColumn(
+        ColumnDefinition("byte_offset", LogicalType::UBIGINT));
+    info->columns.AddColumn(ColumnDefinition("smiles", LogicalType::VARCHAR));
+    info->columns.AddColumn(ColumnDefinition("name", LogicalType::VARCHAR));
+    info->columns.AddColumn(ColumnDefinition("error", LogicalType::VARCHAR));
+    catalog.CreateTable(context, std::move(info));
+  }
+
+  auto &fs = FileSystem::GetFileSystem(context);
+  for (auto &file : bind_data.files) {
+    auto handle = fs.OpenFile(file, FileFlags::FILE_FLAGS_READ);
+    auto file_size = handle->GetFileSize();
+    file_sizes.push_back(file_size);
+    total_size += file_size;
+    range_count +=
+        (file_size + bind_data.buffer_size - 1) / bind_data.buffer_size;
+  }
+  max_threads = duckdb_rdkit::MemoryBoundThreads(
+      context, THREAD_MEMORY, MaxValue<idx_t>(range_count, 1));
+}
+
+bool SMILESScanGlobalState::ClaimRange(SMILESScanRange &range) {
+  lock_guard<mutex> guard(lock);
+  //! Move on to the next file once the current one has been handed out.
+  //! Empty files have no ranges
+  while (next_file_idx < file_sizes.size() &&
+         next_range_start >= file_sizes[next_file_idx]) {
+    next_file_idx++;
+    next_range_start = 0;
+  }
+  if (next_file_idx >= file_sizes.size()) {
+    return false;
+  }
+  range.range_idx = next_range_idx++;
+  range.file_idx = next_file_idx;
+  range.start = next_range_start;
+  range.end = MinValue<idx_t>(range.start + bind_data.buffer_size,
+                              file_sizes[next_file_idx]);
+  next_range_start = range.end;
+  return true;
+}
+
+idx_t SMILESScanGlobalState::MaxThreads() const { return max_threads; }
+
+void SMILESScanGlobalState::AppendRejects(
+    ClientContext &context, const vector<SMILESReject> &rejects) {
+  lock_guard<mutex> guard(rejects_lock);
+  auto &table = Catalog::GetEntry<TableCatalogEntry>(
+      context, TEMP_CATALOG, DEFAULT_SCHEMA, bind_data.rejects_table);
+  InternalAppender appender(context, table);
+  for (auto &reject : rejects) {
+    appender.BeginRow();
+    appender.Append(Value(bind_data.files[reject.file_idx]));
+    appender.Append(Value::UBIGINT(reject.byte_offset));
+    appender.Append(Value(reject.smiles));
+    appender.Append(reject.name.empty() ? Value() : Value(reject.name));
+    appender.Append(Value(reject.error));
+    appender.EndRow();
+  }
+  appender.Close();
+}
+
+SMILESScanLocalState::SMILESScanLocalState(ClientContext &context_p,
+                                           SMILESScanGlobalState &gstate_p)
+    : scan_count(0), range{0, 0, 0, 0}, bind_data(gstate_p.bind_data),
+      context(context_p), fs(FileSystem::GetFileSystem(context_p)),
+      mol_options(duckdb_rdkit::GetUmbraMolOptions(context_p)),
+      memory(context_p) {
+  memory.Resize(SMILESScanGlobalState::THREAD_MEMORY);
+}
+
+void SMILESScanLocalState::ReserveMolMemory(const RDKit::ROMol &mol) {
+  auto size = duckdb_rdkit::EstimateMolMemory(mol);
+  if (size > mol_memory) {
+    mol_memory = size;
+    memory.Resize(SMILESScanGlobalState::THREAD_MEMORY + mol_memory);
+  }
+}
+
+SMILESGlobalTableFunctionState::SMILESGlobalTableFunctionState(
+    ClientContext &context, TableFunctionInitInput &input)
+    : state(context, input.bind_data->Cast<SMILESScanData>(),
+            input.column_ids) {}
+
+SMILESLocalTableFunctionState::SMILESLocalTableFunctionState(
+    ClientContext &context_p, SMILESScanGlobalState &gstate_p)
+    : state(context_p, gstate_p) {}
+
+void SMILESScanLocalState::ExtractNextChunk(SMILESScanGlobalState &gstate,
+                                            DataChunk &output) {
+  scan_count = 0;
+  auto column_count = gstate.column_kinds.size();
+  bool has_rejects_table = !bind_data.rejects_table.empty();
+
+  while (scan_count < STANDARD_VECTOR_SIZE) {
+    if (!range_active) {
+      //! A chunk only holds molecules of one range, so that its batch index
+      //! is the index of that range
+      if (scan_count > 0) {
+        break;
+      }
+      if (!gstate.ClaimRange(range)) {
+        break;
+      }
+      if (range.file_idx != file_handle_idx) {
+        file_handle = fs.OpenFile(bind_data.files[range.file_idx],
+                                  FileFlags::FILE_FLAGS_READ);
+        file_handle_idx = range.file_idx;
+      }
+      reader.Reset(*file_handle, gstate.file_sizes[range.file_idx], range,
+                   bind_data.header);
+      range_active = true;
+    }
+
+    idx_t line_start;
+    if (!reader.NextLine(line, line_start)) {
+      range_active = false;
+      gstate.bytes_scanned += range.end - range.start;
+      if (!rejects.empty()) {
+        gstate.AppendRejects(context, rejects);
+        rejects.clear();
+      }
+      continue;
+    }
+    std::string_view smiles, name;
+    if (!SMILESLineParser::Split(line, smiles, name)) {
+      continue;
+    }
+
+    std::unique_ptr<RDKit::RWMol> mol;
+    if (gstate.parse_mols) {
+      mol = parser.Parse(smiles, mol_options.sanitize, error);
+      if (!mol && has_rejects_table) {
+        rejects.push_back(SMILESReject{range.file_idx, line_start,
+                                       string(smiles), string(name), error});
+        continue;
+      }
+    }
+
+    for (idx_t i = 0; i < column_count; i++) {
+      auto &col = output.data[i];
+      switch (gstate.column_kinds[i]) {
+      case SMILESColumnKind::MOL: {
+        if (!mol) {
+          FlatVector::SetNull(col, scan_count, true);
+          break;
+        }
+        ReserveMolMemory(*mol);
+        //! the molecule column is a BLOB with potentially invalid UTF8
+        auto umbra_mol = duckdb_rdkit::get_umbra_mol_string(*mol, mol_options);
+        FlatVector::GetData<string_t>(col)[scan_count] =
+            StringVector::AddStringOrBlob(col, umbra_mol);
+        break;
+      }
+      case SMILESColumnKind::NAME:
+        if (name.empty()) {
+          FlatVector::SetNull(col, scan_count, true);
+          break;
+        }
+        FlatVector::GetData<string_t>(col)[scan_count] =
+            StringVector::AddString(col, name.data(), name.size());
+        break;
+      default:
+        //! These are the same for every molecule of the chunk
+        break;
+      }
+    }
+    scan_count++;
+  }
+
+  if (scan_count == 0) {
+    return;
+  }
+  for (idx_t i = 0; i < column_count; i++) {
+    auto &col = output.data[i];
+    switch (gstate.column_kinds[i]) {
+    case SMILESColumnKind::VIRTUAL:
+      col.SetVectorType(VectorType::CONSTANT_VECTOR);
+      ConstantVector::SetNull(col, true);
+      break;
+    case SMILESColumnKind::FILENAME:
+      //! A chunk only holds molecules of one range, and so of one file
+      col.SetVectorType(VectorType::CONSTANT_VECTOR);
+      ConstantVector::GetData<string_t>(col)[0] =
+          StringVector::AddString(col, bind_data.files[range.file_idx]);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+double SMILESScan::ScanProgress(ClientContext &, const FunctionData *,
+                                const GlobalTableFunctionState *global_state) {
+  auto &gstate = global_state->Cast<SMILESGlobalTableFunctionState>().state;
+  if (gstate.total_size == 0) {
+    return 100.0;
+  }
+  return 100.0 * (double)gstate.bytes_scanned.load() /
+         (double)gstate.total_size;
+}
+
+OperatorPartitionData
+SMILESScan::GetPartitionData(ClientContext &,
+                             TableFunctionGetPartitionInput &input) {
+  auto &lstate =
+      input.local_state->Cast<SMILESLocalTableFunctionState>().state;
+  return OperatorPartitionData(lstate.range.range_idx);
+}
+
+} // namespace duckdb
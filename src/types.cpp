@@ -14,9 +14,28 @@ LogicalType Mol() {
   return blob_type;
 }
 
+// Bit-vector fingerprint, see bfp.hpp for the layout
+LogicalType Bfp() {
+  auto blob_type = LogicalType(LogicalTypeId::BLOB);
+  blob_type.SetAlias("bfp");
+  return blob_type;
+}
+
+// A substructure query written in SMARTS. The SMARTS text is stored as is,
+// and compiled when the query is used
+LogicalType QMol() {
+  auto varchar_type = LogicalType(LogicalTypeId::VARCHAR);
+  varchar_type.SetAlias("qmol");
+  return varchar_type;
+}
+
 void RegisterTypes(ExtensionLoader &loader) {
   // Register Mol type
   loader.RegisterType("Mol", Mol());
+  // Register bfp type
+  loader.RegisterType("bfp", Bfp());
+  // Register qmol type
+  loader.RegisterType("qmol", QMol());
 }
 
 } // namespace duckdb_rdkit
@@ -1,8 +1,15 @@
 #include "umbra_mol.hpp"
+#include "bfp.hpp"
 #include "common.hpp"
 #include "duckdb/common/exception.hpp"
+#include "duckdb/common/string_util.hpp"
+#include "duckdb/main/client_context.hpp"
+#include "duckdb/main/config.hpp"
 #include "mol_formats.hpp"
+#include <GraphMol/Fingerprints/Fingerprints.h>
+#include <GraphMol/MolOps.h>
 #include <GraphMol/SmilesParse/SmilesParse.h>
+#include <GraphMol/SmilesParse/SmilesWrite.h>
 #include <GraphMol/Substruct/SubstructMatch.h>
 #include <cstdint>
 #include <string>
@@ -22,49 +29,95 @@ namespace duckdb_rdkit {
 // This is used for a substructure filter and placed in the prefix of a
 // Umbra-mol so that short-circuiting can take place and save on computation
 // cost when deserializing and a full substructure search is unnecessary.
-std::vector<std::vector<string>> dalke_counts = {{"O", "2", "3", "1", "4", "5"},
-                                                 {"Ccc", "2", "4"},
-                                                 {"CCN", "1"},
-                                                 {"cnc", "1"},
-                                                 {"cN", "1"},
-                                                 {"C=O", "1"},
-                                                 {"CCC", "1"},
-                                                 {"S", "1"},
-                                                 {"c1ccccc1", "1", "2"},
-                                                 {"N", "2", "3", "1"},
-                                                 {"C=C", "1"},
-                                                 {"nn", "1"},
-                                                 {"CO", "2"},
-                                                 {"Ccn", "1", "2"},
-                                                 {"CCCCC", "1"},
-                                                 {"cc(c)c", "1"},
-                                                 {"CNC", "2"},
-                                                 {"s", "1"},
-                                                 {"CC(C)C", "1"},
-                                                 {"o", "1"},
-                                                 {"cncnc", "1"},
-                                                 {"C=N", "1"},
-                                                 {"CC=O", "2", "3"},
-                                                 {"Cl", "1"},
-                                                 {"ccncc", "2"},
-                                                 {"CCCCCC", "6"},
-                                                 {"F", "1"},
-                                                 {"CCOC", "3"},
-                                                 {"c(cn)n", "1"},
-                                                 {"C", "9", "6", "1"},
-                                                 {"CC=C(C)C", "1"},
-                                                 {"c1ccncc1", "1"},
-                                                 {"CC(C)N", "1"},
-                                                 {"CC", "1"},
-                                                 {"CCC(C)O", "4"},
-                                                 {"ccc(cc)n", "2"},
-                                                 {"C1CCCC1", "1"},
-                                                 {"CNCN", "1"},
-                                                 {"cncn", "3"},
-                                                 {"CSC", "1"},
-                                                 {"CCNCCCN", "1"},
-                                                 {"CccC", "1"},
-                                                 {"ccccc(c)c", "3"}};
+//
+// fragment SMILES -> the match counts for which a bit is set, in bit order
+using DalkeCounts =
+    std::vector<std::pair<std::string, std::vector<unsigned int>>>;
+DalkeCounts dalke_counts = {{"O", {2, 3, 1, 4, 5}},
+                             {"Ccc", {2, 4}},
+                             {"CCN", {1}},
+                             {"cnc", {1}},
+                             {"cN", {1}},
+                             {"C=O", {1}},
+                             {"CCC", {1}},
+                             {"S", {1}},
+                             {"c1ccccc1", {1, 2}},
+                             {"N", {2, 3, 1}},
+                             {"C=C", {1}},
+                             {"nn", {1}},
+                             {"CO", {2}},
+                             {"Ccn", {1, 2}},
+                             {"CCCCC", {1}},
+                             {"cc(c)c", {1}},
+                             {"CNC", {2}},
+                             {"s", {1}},
+                             {"CC(C)C", {1}},
+                             {"o", {1}},
+                             {"cncnc", {1}},
+                             {"C=N", {1}},
+                             {"CC=O", {2, 3}},
+                             {"Cl", {1}},
+                             {"ccncc", {2}},
+                             {"CCCCCC", {6}},
+                             {"F", {1}},
+                             {"CCOC", {3}},
+                             {"c(cn)n", {1}},
+                             {"C", {9, 6, 1}},
+                             {"CC=C(C)C", {1}},
+                             {"c1ccncc1", {1}},
+                             {"CC(C)N", {1}},
+                             {"CC", {1}},
+                             {"CCC(C)O", {4}},
+                             {"ccc(cc)n", {2}},
+                             {"C1CCCC1", {1}},
+                             {"CNCN", {1}},
+                             {"cncn", {3}},
+                             {"CSC", {1}},
+                             {"CCNCCCN", {1}},
+                             {"CccC", {1}},
+                             {"ccccc(c)c", {3}}};
+
+// A dalke fragment parsed into a query molecule, along with the match count
+// thresholds of its bits
+struct DalkeFragment {
+  std::unique_ptr<RDKit::ROMol> mol;
+  std::vector<unsigned int> thresholds;
+};
+
+static std::vector<DalkeFragment> BuildDalkeFragments() {
+  std::vector<DalkeFragment> fragments;
+  fragments.reserve(dalke_counts.size());
+  for (const auto &[smiles, thresholds] : dalke_counts) {
+    DalkeFragment fragment;
+    try {
+      fragment.mol.reset(RDKit::SmilesToMol(smiles, 0, false));
+    } catch (std::exception &e) {
+      std::string msg = StringUtil::Format("%s", typeid(e).name());
+      throw InvalidInputException(msg);
+    }
+    if (!fragment.mol) {
+      throw InternalException("Could not parse dalke fragment %s", smiles);
+    }
+    // The fragments are shared read-only between all threads. Compute
+    // anything that RDKit would otherwise lazily compute (and write to the
+    // molecule) during a substructure match up front
+    fragment.mol->updatePropertyCache(false);
+    RDKit::MolOps::fastFindRings(*fragment.mol);
+
+    fragment.thresholds = thresholds;
+    fragments.push_back(std::move(fragment));
+  }
+  return fragments;
+}
+
+// The fragments are parsed only once and are immutable afterwards.
+// Initialization of a function-local static is thread-safe.
+static const std::vector<DalkeFragment> &GetDalkeFragments() {
+  static const std::vector<DalkeFragment> fragments = BuildDalkeFragments();
+  return fragments;
+}
+
+void PrecompileDalkeFragments() { GetDalkeFragments(); }
 
 uint64_t make_dalke_fp(const RDKit::ROMol &mol) {
   std::bitset<64> bs;
@@ -73,6 +126,8 @@ uint64_t make_dalke_fp(const RDKit::ROMol &mol) {
   params.useQueryQueryMatches = false;
   params.recursionPossible = true;
   params.useChirality = false;
+  // NOTE: changing this changes the bits that are set, which would invalidate
+  // the dalke fps of already stored molecules
   params.maxMatches = 10;
   params.numThreads = 1;
 
@@ -81,22 +136,13 @@ uint64_t make_dalke_fp(const RDKit::ROMol &mol) {
   // in the target molecule (the one that an UmbraMol will be constructed for)
   // the dalke fragment is the "query" molecule in the SubstructMatch
   // function
-  for (const auto &fp : dalke_counts) {
-    std::unique_ptr<RDKit::ROMol> dalke_fp_mol;
-
-    try {
-      dalke_fp_mol.reset(RDKit::SmilesToMol(fp[0], 0, false));
-    } catch (std::exception &e) {
-      std::string msg = StringUtil::Format("%s", typeid(e).name());
-      throw InvalidInputException(msg);
-    }
-
-    auto matchVect = RDKit::SubstructMatch(mol, *dalke_fp_mol, params);
+  for (const auto &fragment : GetDalkeFragments()) {
+    auto matchVect = RDKit::SubstructMatch(mol, *fragment.mol, params);
 
     // if the target has the fp substructure in it at least $NUMBER of times
     // it appears, set that bit
-    for (auto i = 1; i < fp.size(); i++) {
-      if (matchVect.size() >= std::stoi(fp[i])) {
+    for (auto threshold : fragment.thresholds) {
+      if (matchVect.size() >= threshold) {
         bs.set(curBit);
       }
 
@@ -108,21 +154,205 @@ uint64_t make_dalke_fp(const RDKit::ROMol &mol) {
   return k;
 }
 
+uint64_t make_mol_hash(const RDKit::ROMol &mol) {
+  // 64-bit FNV-1a over the SMILES, followed by the murmur3 finalizer to mix
+  // the high bits. This is written out rather than using duckdb's Hash,
+  // because the hashes are stored and must be the same in every version
+  auto smiles = RDKit::MolToSmiles(mol, false);
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (auto c : smiles) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 0x100000001b3ULL;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+uint64_t get_mol_hash(const umbra_mol_t &umbra_mol) {
+  if (umbra_mol.HasHeader() && umbra_mol.IsSanitized()) {
+    return umbra_mol.GetMolHash();
+  }
+  auto mol = rdkit_mol_from_umbra_mol(umbra_mol);
+  return make_mol_hash(*mol);
+}
+
+static constexpr const char *SCREEN_BITS_SETTING = "rdkit_mol_screen_bits";
+static constexpr const char *SANITIZE_SETTING = "rdkit_sanitize";
+static constexpr const char *STORAGE_SETTING = "rdkit_mol_storage";
+static constexpr const char *DESCRIPTORS_SETTING = "rdkit_mol_descriptors";
+// The number of screen words has to fit in the 2 bytes of the header, but
+// anything this wide is well past the point where a wider screen helps
+static constexpr idx_t MAX_SCREEN_BITS = 8192;
+
+static void SetScreenBits(ClientContext &context, SetScope scope,
+                          Value &parameter) {
+  // Screens are only compared when they have the same number of words, so
+  // the width must be a whole number of words for that to mean the same
+  // number of bits
+  auto bits = UBigIntValue::Get(parameter);
+  if (bits > MAX_SCREEN_BITS || bits % 64 != 0) {
+    throw InvalidInputException(
+        "%s must be a multiple of 64 between 0 and %d, got %d",
+        SCREEN_BITS_SETTING, MAX_SCREEN_BITS, bits);
+  }
+}
+
+static MolStorage ParseStorage(const Value &parameter) {
+  auto storage = StringUtil::Lower(StringValue::Get(parameter));
+  if (storage == "pickle") {
+    return MolStorage::PICKLE;
+  }
+  if (storage == "smiles") {
+    return MolStorage::SMILES;
+  }
+  throw InvalidInputException("%s must be 'pickle' or 'smiles', got '%s'",
+                              STORAGE_SETTING, StringValue::Get(parameter));
+}
+
+static void SetStorage(ClientContext &context, SetScope scope,
+                       Value &parameter) {
+  ParseStorage(parameter);
+}
+
+void RegisterUmbraMolSettings(ExtensionLoader &loader) {
+  auto &config = DBConfig::GetConfig(loader.GetDatabaseInstance());
+  config.AddExtensionOption(
+      SCREEN_BITS_SETTING,
+      "Number of bits of the RDKit pattern fingerprint stored in new Mol "
+      "values to screen substructure searches. 0 stores no screen",
+      LogicalType::UBIGINT, Value::UBIGINT(0), SetScreenBits);
+  config.AddExtensionOption(
+      SANITIZE_SETTING,
+      "Whether new Mol values are sanitized when they are parsed. Values "
+      "that are not sanitized are only sanitized when they are used, and are "
+      "not screened in substructure searches",
+      LogicalType::BOOLEAN, Value::BOOLEAN(true));
+  config.AddExtensionOption(
+      STORAGE_SETTING,
+      "How new Mol values store the molecule: 'pickle' (an RDKit pickle) or "
+      "'smiles' (a CXSMILES, which is smaller but slower to read)",
+      LogicalType::VARCHAR, Value("pickle"), SetStorage);
+  config.AddExtensionOption(
+      DESCRIPTORS_SETTING,
+      "Whether new Mol values store their AMW, LogP, heavy atom, ring, HBD "
+      "and HBA counts, which the mol_* functions then read without RDKit",
+      LogicalType::BOOLEAN, Value::BOOLEAN(false));
+}
+
+UmbraMolOptions GetUmbraMolOptions(ClientContext &context) {
+  UmbraMolOptions options;
+  Value value;
+  if (context.TryGetCurrentSetting(SCREEN_BITS_SETTING, value) &&
+      !value.IsNull()) {
+    options.screen_bits = UBigIntValue::Get(value);
+  }
+  if (context.TryGetCurrentSetting(SANITIZE_SETTING, value) &&
+      !value.IsNull()) {
+    options.sanitize = BooleanValue::Get(value);
+  }
+  if (context.TryGetCurrentSetting(STORAGE_SETTING, value) &&
+      !value.IsNull()) {
+    options.storage = ParseStorage(value);
+  }
+  if (context.TryGetCurrentSetting(DESCRIPTORS_SETTING, value) &&
+      !value.IsNull()) {
+    options.descriptors = BooleanValue::Get(value);
+  }
+  return options;
+}
+
 // "Umbra-mol" has more than just the binary molecule
 // There is a prefix in front of the binary molecule, inspired by
-// Umbra-style strings
-std::string get_umbra_mol_string(const RDKit::ROMol &mol) {
-  auto binary_mol = rdkit_mol_to_binary_mol(mol);
-  size_t total_size = umbra_mol_t::DALKE_FP_PREFIX_BYTES + binary_mol.size();
+// Umbra-style strings, followed by a header, see umbra_mol_t
+// The SMILES stored in place of the pickle with FLAG_SMILES. The CXSMILES
+// extensions keep what plain SMILES cannot express, e.g. enhanced stereo,
+// but not the coordinates
+static std::string make_storage_smiles(const RDKit::ROMol &mol) {
+  RDKit::SmilesWriteParams params;
+  return RDKit::MolToCXSmiles(
+      mol, params, RDKit::SmilesWrite::CXSmilesFields::CX_ALL_BUT_COORDS);
+}
+
+// The counts are stored in 16 bits, which no molecule that RDKit can handle
+// in reasonable time exceeds, but they are clamped rather than wrapped
+static uint16_t clamp_count(unsigned int count) {
+  return MinValue<unsigned int>(count, NumericLimits<uint16_t>::Maximum());
+}
+
+static HeaderDescriptors make_header_descriptors(const RDKit::ROMol &mol) {
+  HeaderDescriptors descriptors;
+  double logp, mr;
+  RDKit::Descriptors::calcCrippenDescriptors(mol, logp, mr);
+  descriptors.amw = RDKit::Descriptors::calcAMW(mol);
+  descriptors.logp = logp;
+  descriptors.num_heavy_atoms = clamp_count(mol.getNumHeavyAtoms());
+  descriptors.num_rings = clamp_count(RDKit::Descriptors::calcNumRings(mol));
+  descriptors.hbd = clamp_count(RDKit::Descriptors::calcNumHBD(mol));
+  descriptors.hba = clamp_count(RDKit::Descriptors::calcNumHBA(mol));
+  return descriptors;
+}
+
+std::string get_umbra_mol_string(const RDKit::ROMol &mol,
+                                 const UmbraMolOptions &options) {
+  uint8_t flags = 0;
+  std::string binary_mol;
+  if (options.storage == MolStorage::SMILES) {
+    flags |= umbra_mol_t::FLAG_SMILES;
+    binary_mol = make_storage_smiles(mol);
+  } else {
+    binary_mol = rdkit_mol_to_binary_mol(mol);
+  }
+  uint64_t dalke_fp;
+  std::string screen;
+  uint64_t mol_hash;
+  std::string descriptors;
+  if (options.sanitize) {
+    dalke_fp = make_dalke_fp(mol);
+    // The screen has the word layout of a bfp, without the bfp header
+    if (options.screen_bits > 0) {
+      std::unique_ptr<ExplicitBitVect> fp(
+          RDKit::PatternFingerprintMol(mol, options.screen_bits));
+      screen = make_bfp_string(*fp).substr(bfp_t::HEADER_BYTES);
+    }
+    mol_hash = make_mol_hash(mol);
+    if (options.descriptors) {
+      flags |= umbra_mol_t::FLAG_DESCRIPTORS;
+      auto header_descriptors = make_header_descriptors(mol);
+      descriptors.assign(reinterpret_cast<const char *>(&header_descriptors),
+                         umbra_mol_t::DESCRIPTOR_BYTES);
+    }
+  } else {
+    // Nothing is computed from the molecule, see FLAG_UNSANITIZED
+    flags |= umbra_mol_t::FLAG_UNSANITIZED;
+    dalke_fp = ~uint64_t(0);
+    mol_hash = 0;
+  }
 
-  uint64_t dalke_fp = make_dalke_fp(mol);
+  uint32_t magic = umbra_mol_t::HEADER_MAGIC;
+  uint8_t version = descriptors.empty()
+                        ? umbra_mol_t::HEADER_VERSION
+                        : umbra_mol_t::HEADER_VERSION_DESCRIPTORS;
+  uint16_t screen_words = screen.size() / umbra_mol_t::SCREEN_WORD_BYTES;
 
   // remember to keep endianess in mind if you print things out.
   // little endian on my machine
   std::string buffer;
-  buffer.reserve(total_size);
+  buffer.reserve(umbra_mol_t::HEADER_BYTES + screen.size() +
+                 descriptors.size() + binary_mol.size());
   buffer.append(reinterpret_cast<const char *>(&dalke_fp),
                 umbra_mol_t::DALKE_FP_PREFIX_BYTES);
+  buffer.append(reinterpret_cast<const char *>(&magic), sizeof(magic));
+  buffer.append(reinterpret_cast<const char *>(&version), sizeof(version));
+  buffer.append(reinterpret_cast<const char *>(&flags), sizeof(flags));
+  buffer.append(reinterpret_cast<const char *>(&screen_words),
+                sizeof(screen_words));
+  buffer.append(reinterpret_cast<const char *>(&mol_hash), sizeof(mol_hash));
+  buffer.append(screen);
+  buffer.append(descriptors);
   buffer.append(binary_mol);
 
   return buffer;